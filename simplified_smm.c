@@ -1,334 +1,4047 @@
-#define _GNU_SOURCE
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <sys/mman.h> // use mmap, munmap system calls
-
-// ==== About Heap Management in Per-process memory space =======
-//
-// Implementation notes:
-// sbrk/brk is obselete (should not be used in future)
-// mmap/munmap with some global constants/variables are used to define a heap segment
-//
-// Note: DO NOT MODIFY heap_start, heap_end, heap_current_break directly
-// mm_sbrk is implemented to simulate the expected results of sbrk/brk system calls
-// Use mm_sbrk(). It provides a similar sbrk() function to adjust heap_current_break
-//
-// Heap illustration:
-// heap_end - heap_start = HEAP_SIZE bytes
-//
-// |-------------------| <------ heap_end (the upper limit of the heap)
-// |                   | 
-// |                   |
-// |-------------------| <------ heap_current_break (mm_sbrk(0) returns this address)
-// |                   |
-// |  Heap in used     | 
-// |                   |
-// |                   | 
-// |-------------------| <------ heap_start (the lower limit of the heap)
-
-const int HEAP_SIZE = 8000; // heap size in bytes
-void *heap_start = NULL;
-void *heap_end = NULL;
-void *heap_current_break = NULL;
-
-// Usage:
-//   mm_sbrk(0) returns the current heap break point
-//   if sz > 0, mm_sbrk(sz) moves up the current heap break point (i.e., enlarge the heap in used) and returns the previous break point
-//   if sz < 0, mm_sbrk(sz) moves down the current heap break point (i.e., shrink the heap in used) and returns the previous break point
-void *mm_sbrk(int sz)
-{
-    if (heap_start == NULL || heap_end == NULL || heap_current_break == NULL)
-        return MAP_FAILED; // error address: (void*) -1
-    if (sz == 0)
-        return heap_current_break;
-    // Note: sz is positive
-    if (sz > 0 && heap_current_break + sz <= heap_end)
-    {
-        void *ret = heap_current_break;
-        heap_current_break += sz;
-        return ret;
-    }
-    // Note: sz is negative
-    if (sz < 0 && heap_current_break + sz >= heap_start)
-    {
-        void *ret = heap_current_break;
-        heap_current_break += sz;
-        return ret;
-    }
-    return MAP_FAILED; // error address
-}
-// ==== End heap management =======
-
-const int MAX_POINTERS = 26;
-const int MAX_OPERATIONS = 100;
-
-const char OPERATION_TYPE_MALLOC = 'M';
-const char OPERATION_TYPE_FREE = 'F';
-const char OPERATION_TYPE_COMBINE_NEARBY_FREE = 'C';
-
-#define OPERATION_STR_MALLOC "malloc"
-#define OPERATION_STR_FREE "free"
-#define OPERATION_STR_COMBINE_NEARBY_FREE "combine_nearby_free"
-
-const char META_DATA_STATUS_FREE = 'f';
-const char META_DATA_STATUS_OCCUPIED = 'o';
-
-// Data structure of MetaData
-//
-// The memory layout for this project assignment is:
-//
-// |--------------| <-- heap_current_break
-// | Data N       | 
-// |--------------|
-// | MetaData N   |
-// |--------------|
-// |    ...       |
-// |    ...       |
-// |--------------|
-// | Data 1       | 
-// |--------------|
-// | MetaData 1   | 
-// |--------------| <--- heap_start
-struct
-    __attribute__((__packed__)) // compiler directive, avoid "gcc" padding bytes to struct
-    MetaData
-{
-    size_t size; // 8 bytes (in 64-bit OS)
-    char status; // 1 byte ('f' or 'o')
-};
-
-// calculate the meta data size and store as a constant (exactly 9 bytes)
-const size_t meta_data_size = sizeof(struct MetaData);
-
-void mm_print()
-{
-    void *cur_heap_break = mm_sbrk(0);
-    void *cur = heap_start;
-    int i = 1;
-    while (cur < cur_heap_break)
-    {
-        struct MetaData *md = (struct MetaData *)cur;
-        printf("Block %02d: [%s] size = %4ld %s\n",
-               i++,                                                     // block number - counting from bottom
-               (md->status == META_DATA_STATUS_FREE) ? "FREE" : "OCCP", // free or occupied
-               md->size,
-               md->size == 1 ? "byte" : "bytes"); // size, in term of bytes
-
-        // Advance to the next meta data
-        cur += meta_data_size + md->size;
-    }
-}
-
-int enoughToSplit(struct MetaData *md, size_t size)
-{
-    if (md->size > (size + meta_data_size))
-    {
-        return 1;
-    }
-    return 0;
-}
-
-void *mm_malloc(size_t size)
-{
-    void* lastBlock = NULL;
-
-    void *cur_heap_break = mm_sbrk(0);
-    void *cur = heap_start;
-    while (cur < cur_heap_break)
-    {
-        struct MetaData *md = (struct MetaData *)cur;
-        if (md->status == META_DATA_STATUS_FREE && md->size >= size)
-        {
-            if (enoughToSplit(md, size) == 1)
-            {
-                struct MetaData *new_md = (struct MetaData *)(cur + meta_data_size + size);
-                new_md->size = md->size - size - meta_data_size;
-                new_md->status = META_DATA_STATUS_FREE;
-                md->size = size;
-            }
-            md->status = META_DATA_STATUS_OCCUPIED;
-            return cur + meta_data_size;
-        }
-
-        lastBlock = cur;
-        cur += meta_data_size + md->size;
-    }
-
-    struct MetaData * lastBlockMetaData = (struct MetaData *) lastBlock;
-
-    if (lastBlock == NULL || lastBlockMetaData->status == META_DATA_STATUS_OCCUPIED)
-    {
-        void* start = mm_sbrk(size + meta_data_size);
-        struct MetaData *md = (struct MetaData *) (start);
-        md->size = size;
-        md->status = META_DATA_STATUS_OCCUPIED;
-
-        return start + meta_data_size;
-    } 
-    else
-    {
-        int remainingSize = size - lastBlockMetaData->size;
-
-        void* start = mm_sbrk(remainingSize);
-
-        lastBlockMetaData->size = size;
-        lastBlockMetaData->status = META_DATA_STATUS_OCCUPIED;
-        return lastBlock + meta_data_size;
-    }
-}
-
-void mm_free(void *p)
-{
-    struct MetaData *md = (struct MetaData *)(p - meta_data_size);
-    md->status = META_DATA_STATUS_FREE;
-}
-
-void mm_combine_nearby_free()
-{
-    void *cur_heap_break = mm_sbrk(0);
-    void *cur = heap_start;
-    while (cur < cur_heap_break)
-    {
-
-        struct MetaData *md = (struct MetaData *)cur;
-        while (cur < cur_heap_break && md->status == META_DATA_STATUS_FREE)
-        {
-            void *next = cur + meta_data_size + md->size;
-            if (next < cur_heap_break)
-            {
-                struct MetaData *next_md = (struct MetaData *)next;
-                if (next_md->status == META_DATA_STATUS_FREE)
-                {
-                    md->size += meta_data_size + next_md->size;
-                }
-                else 
-                {
-                    break;
-                }
-            }
-            else 
-            {
-                return;
-            }
-        }
-        cur += meta_data_size + md->size;
-    }
-}
-
-int main()
-{
-    char operation_types[MAX_OPERATIONS];
-    char pointer_chars[MAX_OPERATIONS];
-    int malloc_sizes[MAX_OPERATIONS];
-    int sz_operations;
-    int i, j;
-
-    // Assume there are at most 26 different malloc/free
-    // Here is the rule to map the block_name to pointers index
-    // a=>0, b=>1, ..., z=>25
-    void *pointers[MAX_POINTERS];
-    for (i = 0; i < MAX_POINTERS; i++)
-        pointers[i] = NULL;
-    char *target = NULL;
-
-    char command[30];  // malloc/free/combine_nearby_free
-    char block_name;   // a-z
-    size_t block_size; // a non-negative integer
-
-    scanf("%d", &sz_operations); // read the number of operations
-    for (i = 0; i < sz_operations; i++)
-    {
-        scanf("%s", command);
-        if (strcmp(command, OPERATION_STR_MALLOC) == 0)
-        {
-            scanf(" %c %ld", &block_name, &block_size);
-            operation_types[i] = OPERATION_TYPE_MALLOC;
-            pointer_chars[i] = block_name;
-            malloc_sizes[i] = block_size;
-        }
-        else if (strcmp(command, OPERATION_STR_FREE) == 0)
-        {
-            scanf(" %c", &block_name);
-            operation_types[i] = OPERATION_TYPE_FREE;
-            pointer_chars[i] = block_name;
-        }
-        else if (strcmp(command, OPERATION_STR_COMBINE_NEARBY_FREE) == 0)
-        {
-            operation_types[i] = OPERATION_TYPE_COMBINE_NEARBY_FREE;
-        }
-    }
-
-    heap_start = mmap(NULL, HEAP_SIZE, PROT_READ | PROT_WRITE,
-                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-
-    if (heap_start == MAP_FAILED)
-    {
-        printf("Error in creating heap using mmap\n");
-        exit(-1);
-    }
-    heap_current_break = heap_start;
-    heap_end = heap_start + HEAP_SIZE;
-    
-
-    for (i = 0; i < sz_operations; i++)
-    {
-        if (operation_types[i] == OPERATION_TYPE_MALLOC)
-        {
-            block_name = pointer_chars[i];
-            block_size = malloc_sizes[i];
-            if (pointers[block_name - 'a'] != NULL)
-            {
-                printf("=== %s %c %ld ===\n", OPERATION_STR_MALLOC, block_name, block_size);
-                printf("malloc Error: %c is pointing to some memory address\n", block_name);
-            }
-            else
-            {
-                target = mm_malloc(block_size);
-                if (target != NULL)
-                {
-                    // This operation ensures that the returned pointer is correct
-                    // As we only fill characters up to the block size,
-                    // no meta data should be erased
-                    for (j = 0; j < block_size; j++)
-                        target[j] = ' '; // 2024-Nov-19: Fixed this line 
-                }
-                pointers[block_name - 'a'] = target;
-                printf("=== %s %c %ld ===\n", OPERATION_STR_MALLOC, block_name, block_size);
-                mm_print();
-            }
-        }
-        else if (operation_types[i] == OPERATION_TYPE_FREE)
-        {
-            block_name = pointer_chars[i];
-            if (pointers[block_name - 'a'] == NULL)
-            {
-                printf("=== %s %c ===\n", OPERATION_STR_FREE, block_name);
-                printf("free Error: %c is pointing to NULL\n", block_name);
-            }
-            else
-            {
-                mm_free(pointers[block_name - 'a']);
-                pointers[block_name - 'a'] = NULL;
-                printf("=== %s %c ===\n", OPERATION_STR_FREE, block_name);
-                mm_print();
-            }
-        }
-        else if (operation_types[i] == OPERATION_TYPE_COMBINE_NEARBY_FREE)
-        {
-            mm_combine_nearby_free();
-            printf("=== Combine nearby free blocks ===\n");
-            mm_print();
-        }
-    }
-
-    if (munmap(heap_start, HEAP_SIZE))
-    {
-        // failure case
-        printf("Error in munmap\n");
-        exit(-1);
-    }
-
-    return 0;
-}
\ No newline at end of file
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h> // use mmap, munmap system calls
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// ==== About Heap Management in Per-process memory space =======
+//
+// Implementation notes:
+// sbrk/brk is obselete (should not be used in future)
+// mmap/munmap with some global constants/variables are used to define a heap segment
+//
+// Note: DO NOT MODIFY heap_start, heap_end, heap_current_break directly
+// mm_sbrk is implemented to simulate the expected results of sbrk/brk system calls
+// Use mm_sbrk(). It provides a similar sbrk() function to adjust heap_current_break
+//
+// Heap illustration:
+// heap_end - heap_start = HEAP_SIZE bytes
+//
+// |-------------------| <------ heap_end (the upper limit of the heap)
+// |                   | 
+// |                   |
+// |-------------------| <------ heap_current_break (mm_sbrk(0) returns this address)
+// |                   |
+// |  Heap in used     | 
+// |                   |
+// |                   | 
+// |-------------------| <------ heap_start (the lower limit of the heap)
+
+const int HEAP_SIZE = 8000; // heap size in bytes
+void *heap_start = NULL;
+void *heap_end = NULL;
+void *heap_current_break = NULL;
+
+// Lower limit of the short-lived region at the top of the heap (see mm_malloc_ex)
+// NULL means the region is empty, i.e. it starts at heap_end
+void *heap_short_lived_break = NULL;
+
+void *mm_heap_upper_limit()
+{
+    return heap_short_lived_break == NULL ? heap_end : heap_short_lived_break;
+}
+
+// Prefaulting as the break advances (see mm_set_prefault_mode)
+int mm_prefault_flags = 0;
+void mm_prefault_advance();
+
+unsigned long mm_break_moves = 0; // successful mm_sbrk calls that moved the break
+
+// Layout versions of the heap, one per MM_LAYOUT_GRANULE bytes of address space
+// (wrapping around every MM_LAYOUT_SLOTS granules). A granule's version is bumped
+// whenever a block boundary inside it disappears: free blocks are merged, or the
+// break or the short-lived break gives blocks back. Allocating and freeing only
+// add boundaries, so a block start seen earlier is still one as long as the
+// version of its granule is unchanged (see mm_heap_walk).
+#define MM_LAYOUT_GRANULE_SHIFT 12
+#define MM_LAYOUT_SLOTS 1024 // power of two
+
+unsigned long mm_layout_versions[MM_LAYOUT_SLOTS];
+
+unsigned long *mm_layout_slot(void *p)
+{
+    return &mm_layout_versions[((size_t)(p - heap_start) >> MM_LAYOUT_GRANULE_SHIFT) & (MM_LAYOUT_SLOTS - 1)];
+}
+
+// Block boundaries in [from, to) of the default heap may be gone
+void mm_layout_changed(void *from, void *to)
+{
+    if (from < heap_start || from >= heap_end || to <= from)
+        return; // a private heap
+    size_t first = (size_t)(from - heap_start) >> MM_LAYOUT_GRANULE_SHIFT;
+    size_t last = (size_t)(to - 1 - heap_start) >> MM_LAYOUT_GRANULE_SHIFT;
+    if (last - first >= MM_LAYOUT_SLOTS)
+        last = first + MM_LAYOUT_SLOTS - 1;
+    for (size_t g = first; g <= last; g++)
+        mm_layout_versions[g & (MM_LAYOUT_SLOTS - 1)]++;
+}
+
+// Usage:
+//   mm_sbrk(0) returns the current heap break point
+//   if sz > 0, mm_sbrk(sz) moves up the current heap break point (i.e., enlarge the heap in used) and returns the previous break point
+//   if sz < 0, mm_sbrk(sz) moves down the current heap break point (i.e., shrink the heap in used) and returns the previous break point
+void *mm_sbrk(int sz)
+{
+    if (heap_start == NULL || heap_end == NULL || heap_current_break == NULL)
+        return MAP_FAILED; // error address: (void*) -1
+    if (sz == 0)
+        return heap_current_break;
+    // Note: sz is positive
+    if (sz > 0 && heap_current_break + sz <= mm_heap_upper_limit())
+    {
+        void *ret = heap_current_break;
+        heap_current_break += sz;
+        mm_break_moves++;
+        if (mm_prefault_flags)
+            mm_prefault_advance();
+        return ret;
+    }
+    // Note: sz is negative
+    if (sz < 0 && heap_current_break + sz >= heap_start)
+    {
+        void *ret = heap_current_break;
+        heap_current_break += sz;
+        mm_break_moves++;
+        mm_layout_changed(heap_current_break, ret);
+        return ret;
+    }
+    return MAP_FAILED; // error address
+}
+
+// Whether mm_sbrk can move the break up by bytes. mm_sbrk takes an int, so
+// larger requests must be refused before they are truncated.
+int mm_sbrk_fits(size_t bytes)
+{
+    return bytes <= INT_MAX && bytes <= (size_t)(mm_heap_upper_limit() - mm_sbrk(0));
+}
+// ==== End heap management =======
+
+// ==== Heap lock =======
+//
+// Every public mm_* function holds mm_heap_lock while it touches the heap.
+// The lock is recursive, so they may call each other, and reclaim or async
+// callbacks may allocate and free again on the same thread.
+//
+// A thread that finds the lock taken spins for a while, doubling the pause
+// between attempts up to MM_LOCK_SPIN_LIMIT, since most critical sections are
+// short (on a single CPU the holder cannot run meanwhile, so it does not spin).
+// Then it sleeps on a futex until the holder wakes it. state is 0 when free,
+// 1 when held and 2 when held with sleepers (the holder then wakes one on release).
+//
+// The lock also profiles itself: how often it was taken and contended, how long
+// threads waited for it and how long it was held (outermost acquisitions only).
+// mm_get_stats() reports these figures.
+
+#define MM_LOCK_SPIN_LIMIT 1024 // pauses in the longest spin round
+
+struct HeapLock
+{
+    atomic_int state;
+    _Atomic uintptr_t owner; // mm_thread_id() of the holder, 0 when free
+    int depth;               // recursion depth of the holder
+    struct timespec hold_start;
+
+    // Written by the holder only
+    unsigned long acquisitions;
+    unsigned long contended;
+    unsigned long long wait_ns;
+    unsigned long long max_wait_ns;
+    unsigned long long hold_ns;
+};
+
+struct HeapLock mm_heap_lock = {0};
+atomic_int mm_lock_spin_limit = -1; // MM_LOCK_SPIN_LIMIT, or 0 on a single CPU; set on first contention
+unsigned long mm_heap_ops = 0; // mm_lock calls, lets background work spot idle time
+
+_Thread_local char mm_thread_marker;
+
+// A number unique to the calling thread and never 0
+uintptr_t mm_thread_id()
+{
+    return (uintptr_t)&mm_thread_marker;
+}
+
+unsigned long long mm_elapsed_ns(struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000000ULL + now.tv_nsec - since->tv_nsec;
+}
+
+void mm_cpu_relax()
+{
+#if defined(__x86_64__)
+    _mm_pause();
+#endif
+}
+
+void mm_futex(atomic_int *addr, int op, int value)
+{
+    syscall(SYS_futex, addr, op, value, NULL, NULL, 0);
+}
+
+// Called once the lock is taken at depth 0
+void mm_lock_acquired(uintptr_t self)
+{
+    atomic_store_explicit(&mm_heap_lock.owner, self, memory_order_relaxed);
+    mm_heap_lock.depth = 1;
+    mm_heap_lock.acquisitions++;
+    clock_gettime(CLOCK_MONOTONIC, &mm_heap_lock.hold_start);
+}
+
+void mm_lock()
+{
+    uintptr_t self = mm_thread_id();
+    if (atomic_load_explicit(&mm_heap_lock.owner, memory_order_relaxed) == self)
+    {
+        mm_heap_lock.depth++;
+        mm_heap_ops++;
+        return;
+    }
+
+    int c = 0;
+    if (!atomic_compare_exchange_strong_explicit(&mm_heap_lock.state, &c, 1, memory_order_acquire, memory_order_relaxed))
+    {
+        struct timespec wait_start;
+        clock_gettime(CLOCK_MONOTONIC, &wait_start);
+        int spin_limit = atomic_load_explicit(&mm_lock_spin_limit, memory_order_relaxed);
+        if (spin_limit < 0)
+        {
+            spin_limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? MM_LOCK_SPIN_LIMIT : 0;
+            atomic_store_explicit(&mm_lock_spin_limit, spin_limit, memory_order_relaxed);
+        }
+        int acquired = 0;
+        for (int pauses = 1; pauses <= spin_limit && !acquired; pauses *= 2)
+        {
+            for (int i = 0; i < pauses; i++)
+                mm_cpu_relax();
+            c = 0;
+            acquired = atomic_load_explicit(&mm_heap_lock.state, memory_order_relaxed) == 0 &&
+                       atomic_compare_exchange_strong_explicit(&mm_heap_lock.state, &c, 1, memory_order_acquire, memory_order_relaxed);
+        }
+        if (!acquired)
+        {
+            // Announce a sleeper (state 2) and sleep until the lock is free
+            while (atomic_exchange_explicit(&mm_heap_lock.state, 2, memory_order_acquire) != 0)
+                mm_futex(&mm_heap_lock.state, FUTEX_WAIT_PRIVATE, 2);
+        }
+
+        unsigned long long waited = mm_elapsed_ns(&wait_start);
+        mm_heap_lock.contended++;
+        mm_heap_lock.wait_ns += waited;
+        if (waited > mm_heap_lock.max_wait_ns)
+            mm_heap_lock.max_wait_ns = waited;
+    }
+    mm_lock_acquired(self);
+    mm_heap_ops++;
+}
+
+void mm_unlock()
+{
+    if (--mm_heap_lock.depth > 0)
+        return;
+    mm_heap_lock.hold_ns += mm_elapsed_ns(&mm_heap_lock.hold_start);
+    atomic_store_explicit(&mm_heap_lock.owner, 0, memory_order_relaxed);
+    if (atomic_exchange_explicit(&mm_heap_lock.state, 0, memory_order_release) == 2)
+        mm_futex(&mm_heap_lock.state, FUTEX_WAKE_PRIVATE, 1);
+}
+
+int mm_trylock()
+{
+    uintptr_t self = mm_thread_id();
+    if (atomic_load_explicit(&mm_heap_lock.owner, memory_order_relaxed) == self)
+    {
+        mm_heap_lock.depth++;
+        return 1;
+    }
+    int c = 0;
+    if (!atomic_compare_exchange_strong_explicit(&mm_heap_lock.state, &c, 1, memory_order_acquire, memory_order_relaxed))
+        return 0;
+    mm_lock_acquired(self);
+    return 1;
+}
+// ==== End heap lock =======
+
+// ==== Prefaulted heap =======
+//
+// mm_set_prefault_mode(flags, ahead) keeps first-touch page faults off the
+// allocation path. Whenever heap_current_break moves up (or the short-lived region
+// grows down), the pages up to ahead bytes beyond the new break are faulted in:
+//   MM_PREFAULT_TOUCH - fault the pages in (MADV_POPULATE_WRITE, or a write per page)
+//   MM_PREFAULT_MLOCK - mlock the pages, which also faults them in, so they stay resident
+//   MM_PREFAULT_ASYNC - a background thread does the work; the allocating thread
+//                       only publishes how far the heap should be prefaulted
+// Touching uses an atomic add of 0, so it never changes bytes another thread writes.
+// Pages mlocked by a mode stay locked after the breaks pass them; a new mode
+// without MM_PREFAULT_MLOCK unlocks them again.
+
+#define MM_PREFAULT_TOUCH 0x1
+#define MM_PREFAULT_MLOCK 0x2
+#define MM_PREFAULT_ASYNC 0x4
+
+size_t mm_prefault_ahead = 0;
+void *mm_prefault_high = NULL; // bottom region is prefaulted up to here
+void *mm_prefault_low = NULL;  // short-lived region is prefaulted down to here
+pthread_t mm_prefault_thread;
+int mm_prefault_thread_running = 0;
+pthread_mutex_t mm_prefault_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t mm_prefault_cond = PTHREAD_COND_INITIALIZER;
+void *mm_prefault_goal_high = NULL; // work for the background thread
+void *mm_prefault_goal_low = NULL;
+void *mm_mlock_bottom = NULL; // MM_PREFAULT_MLOCK locked [mm_mlock_bottom, mm_prefault_high)
+void *mm_mlock_top = NULL;    // and [mm_prefault_low, mm_mlock_top)
+
+void mm_prefault_range(void *from, void *to, int flags)
+{
+    if (from >= to)
+        return;
+    // mlock fails beyond RLIMIT_MEMLOCK: the pages are then at least faulted in
+    if ((flags & MM_PREFAULT_MLOCK) && mlock(from, to - from) == 0)
+        return;
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(from, to - from, MADV_POPULATE_WRITE) == 0)
+        return;
+#endif
+    size_t page = sysconf(_SC_PAGESIZE);
+    for (char *p = from; p < (char *)to; p += page)
+        __atomic_fetch_add(p, 0, __ATOMIC_RELAXED);
+}
+
+void *mm_page_down(void *p)
+{
+    return (void *)((size_t)p & ~(sysconf(_SC_PAGESIZE) - 1));
+}
+
+void *mm_page_up(void *p)
+{
+    return mm_page_down(p + sysconf(_SC_PAGESIZE) - 1);
+}
+
+void *mm_prefault_worker(void *arg)
+{
+    pthread_mutex_lock(&mm_prefault_mutex);
+    while (mm_prefault_thread_running)
+    {
+        void *from_high = mm_prefault_high, *to_high = mm_prefault_goal_high;
+        void *from_low = mm_prefault_goal_low, *to_low = mm_prefault_low;
+        if (to_high <= from_high && to_low <= from_low)
+        {
+            pthread_cond_wait(&mm_prefault_cond, &mm_prefault_mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&mm_prefault_mutex);
+        mm_prefault_range(from_high, to_high, mm_prefault_flags);
+        mm_prefault_range(from_low, to_low, mm_prefault_flags);
+        pthread_mutex_lock(&mm_prefault_mutex);
+        if (to_high > mm_prefault_high)
+            mm_prefault_high = to_high;
+        if (from_low < mm_prefault_low)
+            mm_prefault_low = from_low;
+    }
+    pthread_mutex_unlock(&mm_prefault_mutex);
+    return NULL;
+}
+
+// Called with mm_heap_lock held after either break moved
+void mm_prefault_advance()
+{
+    void *goal_high = mm_page_up(heap_current_break + mm_prefault_ahead);
+    void *goal_low = mm_page_down(mm_heap_upper_limit() - mm_prefault_ahead);
+    if (goal_high > heap_end)
+        goal_high = heap_end;
+    if (goal_low < heap_start)
+        goal_low = heap_start;
+
+    pthread_mutex_lock(&mm_prefault_mutex);
+    if (mm_prefault_flags & MM_PREFAULT_ASYNC)
+    {
+        mm_prefault_goal_high = goal_high;
+        mm_prefault_goal_low = goal_low;
+        pthread_cond_signal(&mm_prefault_cond);
+    }
+    else
+    {
+        mm_prefault_range(mm_prefault_high, goal_high, mm_prefault_flags);
+        mm_prefault_range(goal_low, mm_prefault_low, mm_prefault_flags);
+        if (goal_high > mm_prefault_high)
+            mm_prefault_high = goal_high;
+        if (goal_low < mm_prefault_low)
+            mm_prefault_low = goal_low;
+    }
+    pthread_mutex_unlock(&mm_prefault_mutex);
+}
+
+// flags == 0 turns the mode off. Returns 0 on success, -1 if the thread cannot be started.
+int mm_set_prefault_mode(int flags, size_t ahead)
+{
+    mm_lock();
+    if (mm_prefault_thread_running)
+    {
+        pthread_mutex_lock(&mm_prefault_mutex);
+        mm_prefault_thread_running = 0;
+        pthread_cond_signal(&mm_prefault_cond);
+        pthread_mutex_unlock(&mm_prefault_mutex);
+        pthread_join(mm_prefault_thread, NULL);
+    }
+    if ((mm_prefault_flags & MM_PREFAULT_MLOCK) && !(flags & MM_PREFAULT_MLOCK))
+    {
+        if (mm_prefault_high > mm_mlock_bottom)
+            munlock(mm_mlock_bottom, mm_prefault_high - mm_mlock_bottom);
+        if (mm_mlock_top > mm_prefault_low)
+            munlock(mm_prefault_low, mm_mlock_top - mm_prefault_low);
+    }
+
+    // Pages below the current break were touched by their users already
+    void *high = mm_page_down(heap_current_break);
+    void *low = mm_page_up(mm_heap_upper_limit());
+    if ((flags & MM_PREFAULT_MLOCK) && (mm_prefault_flags & MM_PREFAULT_MLOCK))
+    {
+        // Still locking: keep the locked ranges whole so they can be unlocked later
+        if (mm_prefault_high > high)
+            high = mm_prefault_high;
+        if (mm_prefault_low < low)
+            low = mm_prefault_low;
+    }
+    else if (flags & MM_PREFAULT_MLOCK)
+    {
+        mm_mlock_bottom = high;
+        mm_mlock_top = low;
+    }
+    mm_prefault_high = high;
+    mm_prefault_low = low;
+    mm_prefault_goal_high = mm_prefault_high;
+    mm_prefault_goal_low = mm_prefault_low;
+    mm_prefault_ahead = ahead;
+    mm_prefault_flags = flags;
+
+    int ret = 0;
+    if (flags & MM_PREFAULT_ASYNC)
+    {
+        mm_prefault_thread_running = 1;
+        if (pthread_create(&mm_prefault_thread, NULL, mm_prefault_worker, NULL) != 0)
+        {
+            mm_prefault_thread_running = 0;
+            mm_prefault_flags &= ~MM_PREFAULT_ASYNC;
+            ret = -1;
+        }
+    }
+    if (flags && heap_start != NULL)
+        mm_prefault_advance();
+    mm_unlock();
+    return ret;
+}
+// ==== End prefaulted heap =======
+
+// ==== Copy and fill kernels =======
+//
+// mm_copy and mm_fill replace memcpy/memset on the allocator's own paths
+// (mm_realloc, mm_calloc, zeroed blocks) and the driver's payload fill.
+// Sizes of at least MM_NON_TEMPORAL_THRESHOLD use AVX2 or SSE2 non-temporal
+// stores, picked once at the first call: a buffer that large would only evict
+// data the caller still needs from the cache. Smaller sizes go to memcpy/memset,
+// whose own vector code measured faster than a plain AVX2 loop (smm_bench kernels).
+
+#define MM_NON_TEMPORAL_THRESHOLD (4UL * 1024 * 1024)
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) void mm_copy_avx2(void *dst, const void *src, size_t n)
+{
+    char *d = dst;
+    const char *s = src;
+    if (n >= MM_NON_TEMPORAL_THRESHOLD)
+    {
+        // Streaming stores need an aligned destination
+        size_t head = (32 - ((size_t)d & 31)) & 31;
+        memcpy(d, s, head);
+        d += head, s += head, n -= head;
+        for (; n >= 128; d += 128, s += 128, n -= 128)
+        {
+            __m256i a = _mm256_loadu_si256((const __m256i *)s);
+            __m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+            __m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+            __m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+            _mm256_stream_si256((__m256i *)d, a);
+            _mm256_stream_si256((__m256i *)(d + 32), b);
+            _mm256_stream_si256((__m256i *)(d + 64), c);
+            _mm256_stream_si256((__m256i *)(d + 96), e);
+        }
+        _mm_sfence();
+    }
+    memcpy(d, s, n);
+}
+
+__attribute__((target("avx2"))) void mm_fill_avx2(void *dst, int c, size_t n)
+{
+    char *d = dst;
+    if (n >= MM_NON_TEMPORAL_THRESHOLD)
+    {
+        __m256i v = _mm256_set1_epi8((char)c);
+        size_t head = (32 - ((size_t)d & 31)) & 31;
+        memset(d, c, head);
+        d += head, n -= head;
+        for (; n >= 128; d += 128, n -= 128)
+        {
+            _mm256_stream_si256((__m256i *)d, v);
+            _mm256_stream_si256((__m256i *)(d + 32), v);
+            _mm256_stream_si256((__m256i *)(d + 64), v);
+            _mm256_stream_si256((__m256i *)(d + 96), v);
+        }
+        _mm_sfence();
+    }
+    memset(d, c, n);
+}
+
+void mm_copy_sse2(void *dst, const void *src, size_t n)
+{
+    char *d = dst;
+    const char *s = src;
+    if (n >= MM_NON_TEMPORAL_THRESHOLD)
+    {
+        size_t head = (16 - ((size_t)d & 15)) & 15;
+        memcpy(d, s, head);
+        d += head, s += head, n -= head;
+        for (; n >= 64; d += 64, s += 64, n -= 64)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *)s);
+            __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+            __m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+            __m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+            _mm_stream_si128((__m128i *)d, a);
+            _mm_stream_si128((__m128i *)(d + 16), b);
+            _mm_stream_si128((__m128i *)(d + 32), c);
+            _mm_stream_si128((__m128i *)(d + 48), e);
+        }
+        _mm_sfence();
+    }
+    memcpy(d, s, n);
+}
+
+void mm_fill_sse2(void *dst, int c, size_t n)
+{
+    char *d = dst;
+    if (n >= MM_NON_TEMPORAL_THRESHOLD)
+    {
+        __m128i v = _mm_set1_epi8((char)c);
+        size_t head = (16 - ((size_t)d & 15)) & 15;
+        memset(d, c, head);
+        d += head, n -= head;
+        for (; n >= 64; d += 64, n -= 64)
+        {
+            _mm_stream_si128((__m128i *)d, v);
+            _mm_stream_si128((__m128i *)(d + 16), v);
+            _mm_stream_si128((__m128i *)(d + 32), v);
+            _mm_stream_si128((__m128i *)(d + 48), v);
+        }
+        _mm_sfence();
+    }
+    memset(d, c, n);
+}
+#endif
+
+void mm_copy_libc(void *dst, const void *src, size_t n)
+{
+    memcpy(dst, src, n);
+}
+
+void mm_fill_libc(void *dst, int c, size_t n)
+{
+    memset(dst, c, n);
+}
+
+void mm_copy_dispatch(void *dst, const void *src, size_t n);
+void mm_fill_dispatch(void *dst, int c, size_t n);
+
+void (*mm_copy)(void *dst, const void *src, size_t n) = mm_copy_dispatch;
+void (*mm_fill)(void *dst, int c, size_t n) = mm_fill_dispatch;
+
+// Pick the kernels for this CPU, then redo the call that got us here
+void mm_kernels_init()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        mm_copy = mm_copy_avx2;
+        mm_fill = mm_fill_avx2;
+    }
+    else
+    {
+        mm_copy = mm_copy_sse2;
+        mm_fill = mm_fill_sse2;
+    }
+#else
+    mm_copy = mm_copy_libc;
+    mm_fill = mm_fill_libc;
+#endif
+}
+
+void mm_copy_dispatch(void *dst, const void *src, size_t n)
+{
+    mm_kernels_init();
+    mm_copy(dst, src, n);
+}
+
+void mm_fill_dispatch(void *dst, int c, size_t n)
+{
+    mm_kernels_init();
+    mm_fill(dst, c, n);
+}
+// ==== End copy and fill kernels =======
+
+const int MAX_POINTERS = 26;
+const int MAX_OPERATIONS = 100;
+
+const char OPERATION_TYPE_MALLOC = 'M';
+const char OPERATION_TYPE_FREE = 'F';
+const char OPERATION_TYPE_COMBINE_NEARBY_FREE = 'C';
+
+#define OPERATION_STR_MALLOC "malloc"
+#define OPERATION_STR_FREE "free"
+#define OPERATION_STR_COMBINE_NEARBY_FREE "combine_nearby_free"
+
+const char META_DATA_STATUS_FREE = 'f';
+const char META_DATA_STATUS_OCCUPIED = 'o';
+const char META_DATA_STATUS_FREE_ZEROED = 'z'; // free, and the payload is all zero bytes
+
+// Data structure of MetaData
+//
+// The memory layout for this project assignment is:
+//
+// |--------------| <-- heap_current_break
+// | Data N       | 
+// |--------------|
+// | MetaData N   |
+// |--------------|
+// |    ...       |
+// |    ...       |
+// |--------------|
+// | Data 1       | 
+// |--------------|
+// | MetaData 1   | 
+// |--------------| <--- heap_start
+struct
+    __attribute__((__packed__)) // compiler directive, avoid "gcc" padding bytes to struct
+    MetaData
+{
+    size_t size; // 8 bytes (in 64-bit OS)
+    char status; // 1 byte ('f', 'o', or a tag for mm_malloc_tagged)
+};
+
+// calculate the meta data size and store as a constant (exactly 9 bytes)
+const size_t meta_data_size = sizeof(struct MetaData);
+
+int mm_is_free(struct MetaData *md)
+{
+    return md->status == META_DATA_STATUS_FREE || md->status == META_DATA_STATUS_FREE_ZEROED;
+}
+
+void mm_print_block(int i, int is_free, size_t size)
+{
+    printf("Block %02d: [%s] size = %4ld %s\n",
+           i,                             // block number - counting from bottom
+           is_free ? "FREE" : "OCCP",     // free or occupied
+           size,
+           size == 1 ? "byte" : "bytes"); // size, in term of bytes
+}
+
+void mm_print_range(void *from, void *to, int i)
+{
+    void *cur = from;
+    while (cur < to)
+    {
+        struct MetaData *md = (struct MetaData *)cur;
+        mm_print_block(i++, mm_is_free(md), md->size);
+
+        // Advance to the next meta data
+        cur += meta_data_size + md->size;
+    }
+}
+
+void mm_print()
+{
+    mm_lock();
+    mm_print_range(heap_start, mm_sbrk(0), 1);
+
+    // The short-lived region is only printed when mm_malloc_ex has placed blocks there
+    if (heap_short_lived_break != NULL && heap_short_lived_break < heap_end)
+    {
+        printf("--- short-lived region ---\n");
+        mm_print_range(heap_short_lived_break, heap_end, 1);
+    }
+    mm_unlock();
+}
+
+int enoughToSplit(struct MetaData *md, size_t size)
+{
+    if (md->size > (size + meta_data_size))
+    {
+        return 1;
+    }
+    return 0;
+}
+
+// Shrink the free block md to exactly size bytes when the remainder can hold
+// another MetaData, turning the remainder into a new free block
+void mm_split_block(struct MetaData *md, size_t size)
+{
+    if (enoughToSplit(md, size) == 1)
+    {
+        struct MetaData *new_md = (struct MetaData *)((void *)md + meta_data_size + size);
+        new_md->size = md->size - size - meta_data_size;
+        // The remainder of a zeroed block is still zeroed
+        new_md->status = md->status == META_DATA_STATUS_FREE_ZEROED ? META_DATA_STATUS_FREE_ZEROED : META_DATA_STATUS_FREE;
+        md->size = size;
+    }
+}
+
+// Defined with the heap limits below
+int mm_check_growth(size_t bytes);
+const int MM_GROWTH_OK = 0;
+const int MM_GROWTH_RETRY = 1;  // memory was reclaimed, search the heap again
+const int MM_GROWTH_DENIED = 2; // the hard limit would be exceeded
+extern int mm_reclaim_done;
+
+// Defined with the growth policy below
+size_t mm_growth_chunk(size_t needed);
+
+// Defined with the emergency reserve below
+void *mm_malloc_emergency(size_t size);
+
+// ==== Cache coloring =======
+//
+// Large blocks from a fresh heap extension or a dedicated mapping all start at the
+// same offset within a page, so arrays walked in lockstep compete for the same
+// L1/L2 cache sets. mm_set_coloring(min_size, colors) staggers blocks of at least
+// min_size bytes by 0, 1, ..., colors - 1 cache lines in turn: heap extensions
+// get a free padding block in front of the new block, dedicated mappings start
+// the MappedHeader color_offset bytes into the mapping. Blocks carved from
+// existing free space are not moved. min_size 0 disables coloring (the default).
+
+#define MM_CACHE_LINE 64
+
+size_t mm_color_min_size = 0;
+unsigned mm_color_count = 1;
+unsigned mm_color_next = 0;
+
+void mm_set_coloring(size_t min_size, unsigned colors)
+{
+    mm_lock();
+    mm_color_min_size = min_size;
+    mm_color_count = colors == 0 ? 1 : colors;
+    mm_color_next = 0;
+    mm_unlock();
+}
+
+// Offset for the next block of the given size: a multiple of MM_CACHE_LINE, or 0
+size_t mm_color_offset(size_t size)
+{
+    if (mm_color_min_size == 0 || size < mm_color_min_size)
+        return 0;
+    return (mm_color_next++ % mm_color_count) * MM_CACHE_LINE;
+}
+// ==== End cache coloring =======
+
+// ==== Dedicated mappings for large blocks =======
+//
+// Blocks of at least mm_mmap_threshold bytes get a mapping of their own instead of
+// heap space (0 disables this). The MetaData sits right before the payload as for
+// heap blocks, with status META_DATA_STATUS_MAPPED, so mm_free recognises them:
+//
+// |--------------|
+// | Data         |
+// |--------------|
+// | MetaData     | <-- status 'm'
+// |--------------|
+// | MappedHeader |
+// |--------------|
+// | color offset | <-- start of the mapping (no bytes without cache coloring)
+// |--------------|
+//
+// mm_realloc resizes them with mremap, so the kernel moves page table entries
+// instead of the allocator copying the payload.
+
+const char META_DATA_STATUS_MAPPED = 'm';
+size_t mm_mmap_threshold = 128 * 1024;
+size_t mm_mapped_bytes = 0; // sum of map_length over all dedicated mappings
+
+struct
+    __attribute__((__packed__))
+    MappedHeader
+{
+    size_t map_length;   // bytes mapped, MappedHeader and color offset included
+    size_t color_offset; // bytes of the mapping before the MappedHeader
+    int tag;             // tag of mm_malloc_tagged, or -1
+};
+
+const size_t mapped_header_size = sizeof(struct MappedHeader) + sizeof(struct MetaData);
+
+void mm_set_mmap_threshold(size_t threshold)
+{
+    mm_lock();
+    mm_mmap_threshold = threshold;
+    mm_unlock();
+}
+
+size_t mm_mapped_length(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (mapped_header_size + size + page - 1) & ~(page - 1);
+}
+
+struct MappedHeader *mm_mapped_header(void *p)
+{
+    return (struct MappedHeader *)(p - mapped_header_size);
+}
+
+void *mm_mapping_start(struct MappedHeader *mh)
+{
+    return (void *)mh - mh->color_offset;
+}
+
+// Payload bytes of a mapped block up to the end of its mapping
+size_t mm_mapped_capacity(struct MappedHeader *mh)
+{
+    return mh->map_length - mh->color_offset - mapped_header_size;
+}
+
+void *mm_malloc_mapped(size_t size)
+{
+    size_t offset = mm_color_offset(size);
+    size_t length = mm_mapped_length(offset + size);
+    if (length < size)
+        return NULL; // overflows
+    int verdict = mm_check_growth(length);
+    if (verdict == MM_GROWTH_RETRY)
+    {
+        void *p = mm_malloc_mapped(size);
+        mm_reclaim_done = 0;
+        return p;
+    }
+    if (verdict == MM_GROWTH_DENIED)
+        return NULL;
+
+    void *start = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (start == MAP_FAILED)
+        return mm_malloc_emergency(size);
+    struct MappedHeader *mh = start + offset;
+    mh->map_length = length;
+    mh->color_offset = offset;
+    mh->tag = -1;
+    mm_mapped_bytes += length;
+
+    void *p = (void *)mh + mapped_header_size;
+    struct MetaData *md = (struct MetaData *)(p - meta_data_size);
+    md->size = size;
+    md->status = META_DATA_STATUS_MAPPED;
+    return p;
+}
+
+void mm_free_mapped(void *p)
+{
+    struct MappedHeader *mh = mm_mapped_header(p);
+    mm_mapped_bytes -= mh->map_length;
+    munmap(mm_mapping_start(mh), mh->map_length);
+}
+
+// ==== End dedicated mappings for large blocks =======
+
+
+// ==== Fit policy =======
+//
+// Which free block mm_malloc_first_fit() takes. First fit stops at the first
+// block that is large enough; best fit scans the whole heap for the smallest
+// one (stopping early on an exact fit). mm_max_scan_length records the most
+// blocks a single search has looked at, the worst case of mm_malloc's latency.
+const int MM_FIT_FIRST = 0;
+const int MM_FIT_BEST = 1;
+
+int mm_fit_policy = 0;
+unsigned long mm_max_scan_length = 0;
+
+void mm_set_fit_policy(int policy)
+{
+    mm_lock();
+    mm_fit_policy = policy;
+    mm_unlock();
+}
+
+// Search the blocks between from and to for a free block of at least size bytes.
+// *last_block is set to the last block looked at when nothing fits, and
+// *max_scan raised to the number of blocks looked at.
+struct MetaData *mm_find_fit(void *from, void *to, size_t size, void **last_block, unsigned long *max_scan)
+{
+    void *cur = from;
+    struct MetaData *fit = NULL;
+    unsigned long scanned = 0;
+    while (cur < to)
+    {
+        struct MetaData *md = (struct MetaData *)cur;
+        scanned++;
+        if (mm_is_free(md) && md->size >= size && (fit == NULL || md->size < fit->size))
+        {
+            fit = md;
+            if (mm_fit_policy == MM_FIT_FIRST || md->size == size)
+                break;
+        }
+
+        *last_block = cur;
+        cur += meta_data_size + md->size;
+    }
+    if (scanned > *max_scan)
+        *max_scan = scanned;
+    return fit;
+}
+// ==== End fit policy =======
+
+void *mm_malloc_first_fit(size_t size)
+{
+    void* lastBlock = NULL;
+
+    if (mm_mmap_threshold != 0 && size >= mm_mmap_threshold)
+        return mm_malloc_mapped(size);
+
+    struct MetaData *fit = mm_find_fit(heap_start, mm_sbrk(0), size, &lastBlock, &mm_max_scan_length);
+    if (fit != NULL)
+    {
+        mm_split_block(fit, size);
+        fit->status = META_DATA_STATUS_OCCUPIED;
+        return (void *)fit + meta_data_size;
+    }
+
+    struct MetaData * lastBlockMetaData = (struct MetaData *) lastBlock;
+
+    // A new block at the break may get a free padding block in front for cache coloring
+    size_t pad = 0;
+    size_t growth;
+    if (lastBlock != NULL && mm_is_free(lastBlockMetaData))
+        growth = size - lastBlockMetaData->size;
+    else
+    {
+        pad = mm_color_offset(size);
+        growth = size + meta_data_size + pad;
+        if (growth < size)
+            return NULL; // overflows
+    }
+    int verdict = mm_check_growth(growth);
+    if (verdict == MM_GROWTH_RETRY)
+    {
+        void *p = mm_malloc_first_fit(size);
+        mm_reclaim_done = 0;
+        return p;
+    }
+    if (verdict == MM_GROWTH_DENIED)
+        return NULL;
+
+    // With a growth policy the heap grows by more than needed;
+    // the surplus is split off as a trailing free block
+    size_t chunk = mm_growth_chunk(growth);
+    if (!mm_sbrk_fits(chunk))
+        return mm_malloc_emergency(size);
+
+    if (lastBlock == NULL || !mm_is_free(lastBlockMetaData))
+    {
+        void* start = mm_sbrk(chunk);
+        if (start == MAP_FAILED)
+            return mm_malloc_emergency(size);
+        if (pad != 0)
+        {
+            struct MetaData *padding = (struct MetaData *)start;
+            padding->size = pad - meta_data_size;
+            padding->status = META_DATA_STATUS_FREE;
+            start += pad;
+            chunk -= pad;
+        }
+        struct MetaData *md = (struct MetaData *) (start);
+        md->size = chunk - meta_data_size;
+        md->status = META_DATA_STATUS_FREE;
+        mm_split_block(md, size);
+        md->status = META_DATA_STATUS_OCCUPIED;
+
+        return start + meta_data_size;
+    } 
+    else
+    {
+        void* start = mm_sbrk(chunk);
+        if (start == MAP_FAILED)
+            return mm_malloc_emergency(size);
+
+        lastBlockMetaData->size += chunk;
+        lastBlockMetaData->status = META_DATA_STATUS_FREE;
+        mm_split_block(lastBlockMetaData, size);
+        lastBlockMetaData->status = META_DATA_STATUS_OCCUPIED;
+        return lastBlock + meta_data_size;
+    }
+}
+
+// Move the lower limit of the short-lived region up past any free blocks at its bottom
+void mm_short_lived_trim()
+{
+    while (heap_short_lived_break != NULL && heap_short_lived_break < heap_end)
+    {
+        struct MetaData *md = (struct MetaData *)heap_short_lived_break;
+        if (!mm_is_free(md))
+            break;
+        mm_layout_changed(heap_short_lived_break, heap_short_lived_break + meta_data_size);
+        heap_short_lived_break += meta_data_size + md->size;
+    }
+}
+
+// Merge runs of adjacent free blocks between from and to
+void mm_combine_range(void *from, void *to)
+{
+    void *cur = from;
+    while (cur < to)
+    {
+
+        struct MetaData *md = (struct MetaData *)cur;
+        while (cur < to && mm_is_free(md))
+        {
+            void *next = cur + meta_data_size + md->size;
+            if (next < to)
+            {
+                struct MetaData *next_md = (struct MetaData *)next;
+                if (mm_is_free(next_md))
+                {
+                    // Two zeroed blocks stay zeroed once the MetaData between them is cleared
+                    int zeroed = md->status == META_DATA_STATUS_FREE_ZEROED && next_md->status == META_DATA_STATUS_FREE_ZEROED;
+                    md->size += meta_data_size + next_md->size;
+                    mm_layout_changed(next, next + meta_data_size);
+                    if (zeroed)
+                        memset(next_md, 0, meta_data_size);
+                    else
+                        md->status = META_DATA_STATUS_FREE;
+                }
+                else 
+                {
+                    break;
+                }
+            }
+            else 
+            {
+                return;
+            }
+        }
+        cur += meta_data_size + md->size;
+    }
+}
+
+void mm_combine_nearby_free()
+{
+    mm_lock();
+    mm_combine_range(heap_start, mm_sbrk(0));
+    if (heap_short_lived_break != NULL)
+        mm_combine_range(heap_short_lived_break, heap_end);
+    mm_unlock();
+}
+
+// ==== Private heaps =======
+//
+// mm_heap_create(size) maps a heap of its own, separate from the default heap
+// (heap_start .. heap_end) and with its own lock. The MMHeap sits at the start of
+// the mapping, so mm_heap_destroy() releases the heap and every block in it with
+// a single munmap. Private heaps keep every block inside the mapping: there are
+// no dedicated mappings, short-lived region, limits or tags, and like mm_free,
+// mm_heap_free() leaves merging free blocks to mm_heap_combine_nearby_free().
+//
+// |--------------|
+// | Blocks  ...  |
+// |--------------| <- start
+// | MMHeap       |
+// |--------------| <- the mapping
+struct MMHeap
+{
+    void *start;
+    void *end;
+    void *current_break;
+    unsigned long max_scan_length;
+    pthread_mutex_t lock;
+};
+
+typedef struct MMHeap mm_heap_t;
+
+mm_heap_t *mm_heap_create(size_t size)
+{
+    void *base = mmap(NULL, sizeof(struct MMHeap) + size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    mm_heap_t *h = base;
+    h->start = base + sizeof(struct MMHeap);
+    h->end = h->start + size;
+    h->current_break = h->start;
+    h->max_scan_length = 0;
+    pthread_mutex_init(&h->lock, NULL);
+    return h;
+}
+
+void mm_heap_destroy(mm_heap_t *h)
+{
+    pthread_mutex_destroy(&h->lock);
+    munmap(h, sizeof(struct MMHeap) + (h->end - h->start));
+}
+
+void *mm_heap_malloc(mm_heap_t *h, size_t size)
+{
+    pthread_mutex_lock(&h->lock);
+    void *last_block = NULL;
+    struct MetaData *md = mm_find_fit(h->start, h->current_break, size, &last_block, &h->max_scan_length);
+    size_t room = h->end - h->current_break;
+    if (md == NULL)
+    {
+        // Grow the break, extending the last block when it is free.
+        // Sizes are compared with the room left, so huge sizes cannot wrap around.
+        if (last_block != NULL && mm_is_free((struct MetaData *)last_block))
+        {
+            md = last_block;
+            if (size - md->size > room)
+                md = NULL;
+            else
+            {
+                h->current_break += size - md->size;
+                md->size = size;
+            }
+        }
+        else if (room >= meta_data_size && size <= room - meta_data_size)
+        {
+            md = h->current_break;
+            md->size = size;
+            h->current_break += meta_data_size + size;
+        }
+    }
+    if (md == NULL)
+    {
+        pthread_mutex_unlock(&h->lock);
+        return NULL;
+    }
+    mm_split_block(md, size);
+    md->status = META_DATA_STATUS_OCCUPIED;
+    pthread_mutex_unlock(&h->lock);
+    return (void *)md + meta_data_size;
+}
+
+void mm_heap_free(mm_heap_t *h, void *p)
+{
+    pthread_mutex_lock(&h->lock);
+    struct MetaData *md = (struct MetaData *)(p - meta_data_size);
+    md->status = META_DATA_STATUS_FREE;
+    pthread_mutex_unlock(&h->lock);
+}
+
+void mm_heap_combine_nearby_free(mm_heap_t *h)
+{
+    pthread_mutex_lock(&h->lock);
+    mm_combine_range(h->start, h->current_break);
+    pthread_mutex_unlock(&h->lock);
+}
+
+void mm_heap_print(mm_heap_t *h)
+{
+    pthread_mutex_lock(&h->lock);
+    mm_print_range(h->start, h->current_break, 1);
+    pthread_mutex_unlock(&h->lock);
+}
+// ==== End private heaps =======
+
+// ==== Compile-time heap policies =======
+//
+// MM_DEFINE_HEAP(name, fit, split, coalesce, lock, header) generates a private
+// heap type struct name with name##_create, _malloc, _free, _combine_nearby_free
+// and _destroy, whose behaviour is fixed by the policies it is given. Each policy
+// is a set of always-inline functions sharing a prefix, so the compiler folds
+// them into the generated code and no policy is looked up at run time:
+//
+//   fit       mm_first_fit, mm_best_fit:
+//             _better(candidate, current) prefers candidate over the current fit,
+//             _stop(candidate, size) ends the search at candidate
+//   split     mm_split_always (as enoughToSplit), mm_split_never:
+//             _ok(block, size, header_size) splits the remainder off
+//   coalesce  mm_coalesce_deferred (as mm_free), mm_coalesce_immediate:
+//             _on_free() merges a freed block with the free blocks around it
+//   lock      mm_lock_none, mm_lock_mutex: _acquire(mutex), _release(mutex)
+//   header    mm_header_meta (struct MetaData), mm_header_compact:
+//             _size() bytes per header, _max_heap() largest heap it can address,
+//             _round(size) payload granularity,
+//             _get_size(b), _is_free(b), _set(b, size, is_free),
+//             _set_prev_free(b, is_free), called on the block after one whose
+//             status changed, and _prev_free(b), the free block before b or
+//             NULL if the header cannot tell
+//
+// MM_DEFINE_HEAP(fast_heap, mm_first_fit, mm_split_always, mm_coalesce_deferred,
+//                mm_lock_none, mm_header_meta)
+// behaves like mm_heap_malloc/mm_heap_free, without the locking.
+
+#define MM_INLINE static inline __attribute__((always_inline))
+
+MM_INLINE int mm_first_fit_better(size_t candidate, size_t current) { return 1; }
+MM_INLINE int mm_first_fit_stop(size_t candidate, size_t size) { return 1; }
+MM_INLINE int mm_best_fit_better(size_t candidate, size_t current) { return candidate < current; }
+MM_INLINE int mm_best_fit_stop(size_t candidate, size_t size) { return candidate == size; }
+
+MM_INLINE int mm_split_always_ok(size_t block, size_t size, size_t header_size) { return block > size + header_size; }
+MM_INLINE int mm_split_never_ok(size_t block, size_t size, size_t header_size) { return 0; }
+
+MM_INLINE int mm_coalesce_deferred_on_free() { return 0; }
+MM_INLINE int mm_coalesce_immediate_on_free() { return 1; }
+
+MM_INLINE void mm_lock_none_acquire(pthread_mutex_t *mutex) {}
+MM_INLINE void mm_lock_none_release(pthread_mutex_t *mutex) {}
+MM_INLINE void mm_lock_mutex_acquire(pthread_mutex_t *mutex) { pthread_mutex_lock(mutex); }
+MM_INLINE void mm_lock_mutex_release(pthread_mutex_t *mutex) { pthread_mutex_unlock(mutex); }
+
+MM_INLINE size_t mm_header_meta_size() { return sizeof(struct MetaData); }
+MM_INLINE size_t mm_header_meta_max_heap() { return SIZE_MAX; }
+MM_INLINE size_t mm_header_meta_round(size_t size) { return size; }
+MM_INLINE size_t mm_header_meta_get_size(void *b) { return ((struct MetaData *)b)->size; }
+MM_INLINE int mm_header_meta_is_free(void *b) { return mm_is_free((struct MetaData *)b); }
+MM_INLINE void mm_header_meta_set_prev_free(void *b, int is_free) {}
+MM_INLINE void *mm_header_meta_prev_free(void *b) { return NULL; }
+MM_INLINE void mm_header_meta_set(void *b, size_t size, int is_free)
+{
+    ((struct MetaData *)b)->size = size;
+    ((struct MetaData *)b)->status = is_free ? META_DATA_STATUS_FREE : META_DATA_STATUS_OCCUPIED;
+}
+
+// A 4-byte header for heaps under 4 GB. Payload sizes are rounded up to 4-byte
+// granules, which leaves the two low bits of the size for flags (payloads are
+// 4-byte aligned):
+//
+// |31 ........................ 2| 1         | 0    |
+// | size                         | prev free | free |
+//
+// A free block also keeps its size in its last 4 bytes, so the block after it
+// can find its start when prev free is set. Payloads are at least one granule
+// to leave room for it.
+const uint32_t MM_COMPACT_FREE = 0x1;
+const uint32_t MM_COMPACT_PREV_FREE = 0x2;
+const uint32_t MM_COMPACT_FLAGS = 0x3;
+
+MM_INLINE size_t mm_header_compact_size() { return sizeof(uint32_t); }
+MM_INLINE size_t mm_header_compact_max_heap() { return UINT32_MAX & ~(size_t)MM_COMPACT_FLAGS; }
+MM_INLINE size_t mm_header_compact_round(size_t size)
+{
+    return size == 0 ? sizeof(uint32_t) : (size + MM_COMPACT_FLAGS) & ~(size_t)MM_COMPACT_FLAGS;
+}
+MM_INLINE size_t mm_header_compact_get_size(void *b) { return *(uint32_t *)b & ~MM_COMPACT_FLAGS; }
+MM_INLINE int mm_header_compact_is_free(void *b) { return *(uint32_t *)b & MM_COMPACT_FREE; }
+MM_INLINE void mm_header_compact_set_prev_free(void *b, int is_free)
+{
+    *(uint32_t *)b = (*(uint32_t *)b & ~MM_COMPACT_PREV_FREE) | (is_free ? MM_COMPACT_PREV_FREE : 0);
+}
+MM_INLINE void mm_header_compact_set(void *b, size_t size, int is_free)
+{
+    *(uint32_t *)b = (uint32_t)size | (*(uint32_t *)b & MM_COMPACT_PREV_FREE) | (is_free ? MM_COMPACT_FREE : 0);
+    if (is_free)
+        *(uint32_t *)(b + size) = (uint32_t)size; // footer: the last 4 bytes of the payload
+}
+MM_INLINE void *mm_header_compact_prev_free(void *b)
+{
+    if (!(*(uint32_t *)b & MM_COMPACT_PREV_FREE))
+        return NULL;
+    return b - sizeof(uint32_t) - *(uint32_t *)(b - sizeof(uint32_t));
+}
+
+#define MM_DEFINE_HEAP(name, fit, split, coalesce, lock, header)                                         \
+    struct name                                                                                          \
+    {                                                                                                    \
+        void *start;                                                                                     \
+        void *end;                                                                                       \
+        void *current_break;                                                                             \
+        pthread_mutex_t mutex;                                                                           \
+    };                                                                                                   \
+                                                                                                         \
+    static inline struct name *name##_create(size_t size)                                                \
+    {                                                                                                    \
+        if (size > header##_max_heap())                                                                  \
+            return NULL;                                                                                 \
+        void *base = mmap(NULL, sizeof(struct name) + size, PROT_READ | PROT_WRITE,                      \
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);                                           \
+        if (base == MAP_FAILED)                                                                          \
+            return NULL;                                                                                 \
+        struct name *h = base;                                                                           \
+        h->start = base + sizeof(struct name);                                                           \
+        h->end = h->start + size;                                                                        \
+        h->current_break = h->start;                                                                     \
+        pthread_mutex_init(&h->mutex, NULL);                                                             \
+        return h;                                                                                        \
+    }                                                                                                    \
+                                                                                                         \
+    static inline void name##_destroy(struct name *h)                                                    \
+    {                                                                                                    \
+        pthread_mutex_destroy(&h->mutex);                                                                \
+        munmap(h, sizeof(struct name) + (h->end - h->start));                                            \
+    }                                                                                                    \
+                                                                                                         \
+    /* Write b's header and tell the block after it whether b is free */                                 \
+    MM_INLINE void name##_set(struct name *h, void *b, size_t size, int is_free)                         \
+    {                                                                                                    \
+        header##_set(b, size, is_free);                                                                  \
+        void *next = b + header##_size() + size;                                                         \
+        if (next < h->current_break)                                                                     \
+            header##_set_prev_free(next, is_free);                                                       \
+    }                                                                                                    \
+                                                                                                         \
+    /* Merge the free block b with the free blocks around it */                                          \
+    MM_INLINE void name##_merge(struct name *h, void *b)                                                 \
+    {                                                                                                    \
+        void *prev;                                                                                      \
+        while ((prev = header##_prev_free(b)) != NULL)                                                   \
+            b = prev;                                                                                    \
+        size_t size = header##_get_size(b);                                                              \
+        void *next = b + header##_size() + size;                                                         \
+        while (next < h->current_break && header##_is_free(next))                                        \
+        {                                                                                                \
+            size += header##_size() + header##_get_size(next);                                           \
+            next = b + header##_size() + size;                                                           \
+        }                                                                                                \
+        name##_set(h, b, size, 1);                                                                       \
+    }                                                                                                    \
+                                                                                                         \
+    static inline void *name##_malloc(struct name *h, size_t size)                                       \
+    {                                                                                                    \
+        size_t requested = size;                                                                         \
+        size = header##_round(size);                                                                     \
+        if (size < requested)                                                                            \
+            return NULL;                                                                                 \
+        lock##_acquire(&h->mutex);                                                                       \
+        void *fit_block = NULL;                                                                          \
+        void *last_block = NULL;                                                                         \
+        for (void *cur = h->start; cur < h->current_break; cur += header##_size() + header##_get_size(cur)) \
+        {                                                                                                \
+            size_t cur_size = header##_get_size(cur);                                                    \
+            if (header##_is_free(cur) && cur_size >= size &&                                             \
+                (fit_block == NULL || fit##_better(cur_size, header##_get_size(fit_block))))             \
+            {                                                                                            \
+                fit_block = cur;                                                                         \
+                if (fit##_stop(cur_size, size))                                                          \
+                    break;                                                                               \
+            }                                                                                            \
+            last_block = cur;                                                                            \
+        }                                                                                                \
+                                                                                                         \
+        if (fit_block == NULL)                                                                           \
+        {                                                                                                \
+            /* Grow the break, extending the last block when it is free */                               \
+            size_t room = h->end - h->current_break;                                                     \
+            if (last_block != NULL && header##_is_free(last_block))                                      \
+            {                                                                                            \
+                size_t grow = size - header##_get_size(last_block);                                      \
+                if (grow <= room)                                                                        \
+                {                                                                                        \
+                    h->current_break += grow;                                                            \
+                    header##_set(last_block, size, 1);                                                   \
+                    fit_block = last_block;                                                              \
+                }                                                                                        \
+            }                                                                                            \
+            else if (room >= header##_size() && size <= room - header##_size())                          \
+            {                                                                                            \
+                fit_block = h->current_break;                                                            \
+                h->current_break += header##_size() + size;                                              \
+                header##_set(fit_block, size, 1);                                                        \
+            }                                                                                            \
+        }                                                                                                \
+        if (fit_block == NULL)                                                                           \
+        {                                                                                                \
+            lock##_release(&h->mutex);                                                                   \
+            return NULL;                                                                                 \
+        }                                                                                                \
+                                                                                                         \
+        size_t block = header##_get_size(fit_block);                                                     \
+        if (split##_ok(block, size, header##_size()))                                                    \
+        {                                                                                                \
+            name##_set(h, fit_block + header##_size() + size, block - size - header##_size(), 1);        \
+            block = size;                                                                                \
+        }                                                                                                \
+        name##_set(h, fit_block, block, 0);                                                              \
+        lock##_release(&h->mutex);                                                                       \
+        return fit_block + header##_size();                                                              \
+    }                                                                                                    \
+                                                                                                         \
+    static inline void name##_free(struct name *h, void *p)                                              \
+    {                                                                                                    \
+        lock##_acquire(&h->mutex);                                                                       \
+        void *b = p - header##_size();                                                                   \
+        name##_set(h, b, header##_get_size(b), 1);                                                       \
+        if (coalesce##_on_free())                                                                        \
+            name##_merge(h, b);                                                                          \
+        lock##_release(&h->mutex);                                                                       \
+    }                                                                                                    \
+                                                                                                         \
+    static inline void name##_combine_nearby_free(struct name *h)                                        \
+    {                                                                                                    \
+        lock##_acquire(&h->mutex);                                                                       \
+        for (void *cur = h->start; cur < h->current_break; cur += header##_size() + header##_get_size(cur)) \
+        {                                                                                                \
+            if (header##_is_free(cur))                                                                   \
+                name##_merge(h, cur);                                                                    \
+        }                                                                                                \
+        lock##_release(&h->mutex);                                                                       \
+    }
+// ==== End compile-time heap policies =======
+
+// ==== Emergency reserve =======
+//
+// mm_set_emergency_reserve(bytes) sets aside a private heap (see mm_heap_create)
+// that is used only when the heap or a dedicated mapping cannot grow any more
+// (mm_sbrk or mmap fails), so error handling, logging and shutdown paths can
+// still allocate. Aligned and short-lived requests (mm_malloc_ex, I/O pools) fall
+// back to it as well. Blocks from the reserve are freed back into it with mm_free and
+// merged with their free neighbours, so it fills up again as they are released.
+// A hard limit (mm_set_heap_limits) is not exhaustion: denied allocations still
+// fail. bytes 0 releases the reserve. The reserve cannot be replaced or released
+// while blocks from it are live; the call then returns 0 and changes nothing.
+
+mm_heap_t *mm_emergency_heap = NULL;
+unsigned long mm_emergency_allocs = 0; // allocations served from the reserve
+size_t mm_emergency_live = 0;          // blocks from the reserve not yet freed
+
+int mm_set_emergency_reserve(size_t bytes)
+{
+    mm_lock();
+    if (mm_emergency_live != 0)
+    {
+        mm_unlock();
+        return 0;
+    }
+    mm_heap_t *heap = NULL;
+    if (bytes != 0 && (heap = mm_heap_create(bytes)) == NULL)
+    {
+        // Keep the old reserve rather than be left with none
+        mm_unlock();
+        return 0;
+    }
+    if (mm_emergency_heap != NULL)
+        mm_heap_destroy(mm_emergency_heap);
+    mm_emergency_heap = heap;
+    mm_unlock();
+    return 1;
+}
+
+int mm_is_emergency_block(void *p)
+{
+    return mm_emergency_heap != NULL && p > mm_emergency_heap->start && p < mm_emergency_heap->end;
+}
+
+// The caller holds mm_heap_lock
+void *mm_malloc_emergency(size_t size)
+{
+    if (mm_emergency_heap == NULL)
+        return NULL;
+    void *p = mm_heap_malloc(mm_emergency_heap, size);
+    if (p == NULL)
+    {
+        // Freed blocks are merged lazily, so merge before giving up
+        mm_heap_combine_nearby_free(mm_emergency_heap);
+        p = mm_heap_malloc(mm_emergency_heap, size);
+    }
+    if (p != NULL)
+    {
+        mm_emergency_allocs++;
+        mm_emergency_live++;
+    }
+    return p;
+}
+
+void mm_free_emergency(void *p)
+{
+    mm_emergency_live--;
+    mm_heap_free(mm_emergency_heap, p);
+    mm_heap_combine_nearby_free(mm_emergency_heap);
+}
+// ==== End emergency reserve =======
+
+// ==== Soft and hard heap limits =======
+//
+// mm_set_heap_limits(soft, hard) caps the bytes in use (both heap regions,
+// MetaData included); 0 disables a limit.
+//
+// Before a growth would cross the soft limit, the allocator calls the reclaim
+// callbacks registered with mm_register_reclaim_callback (e.g. caches dropping
+// entries), combines nearby free blocks and trims free space at the ends of both
+// regions, then searches the heap again. Only then does it grow the heap.
+// A growth that would cross the hard limit fails: the allocation returns NULL.
+
+#define MM_MAX_RECLAIM_CALLBACKS 8
+
+struct ReclaimCallback
+{
+    void (*fn)(size_t bytes_wanted, void *arg);
+    void *arg;
+};
+
+size_t mm_soft_limit = 0;
+size_t mm_hard_limit = 0;
+struct ReclaimCallback mm_reclaim_callbacks[MM_MAX_RECLAIM_CALLBACKS];
+int mm_reclaim_callback_count = 0;
+int mm_reclaim_done = 0; // set while an allocation retries after reclaiming
+unsigned long mm_reclaim_runs = 0;
+
+void mm_set_heap_limits(size_t soft_limit, size_t hard_limit)
+{
+    mm_lock();
+    mm_soft_limit = soft_limit;
+    mm_hard_limit = hard_limit;
+    mm_unlock();
+}
+
+// Returns 0 on success, -1 if the callback table is full
+int mm_register_reclaim_callback(void (*fn)(size_t bytes_wanted, void *arg), void *arg)
+{
+    mm_lock();
+    if (mm_reclaim_callback_count == MM_MAX_RECLAIM_CALLBACKS)
+    {
+        mm_unlock();
+        return -1;
+    }
+    mm_reclaim_callbacks[mm_reclaim_callback_count].fn = fn;
+    mm_reclaim_callbacks[mm_reclaim_callback_count].arg = arg;
+    mm_reclaim_callback_count++;
+    mm_unlock();
+    return 0;
+}
+
+// Bytes taken by both heap regions and the dedicated mappings
+size_t mm_heap_in_use()
+{
+    return (mm_sbrk(0) - heap_start) + (heap_end - mm_heap_upper_limit()) + mm_mapped_bytes;
+}
+
+// Give a trailing free block back by moving heap_current_break down
+void mm_trim()
+{
+    void *cur_heap_break = mm_sbrk(0);
+    void *cur = heap_start;
+    struct MetaData *last = NULL;
+    while (cur < cur_heap_break)
+    {
+        last = (struct MetaData *)cur;
+        cur += meta_data_size + last->size;
+    }
+    if (last != NULL && mm_is_free(last))
+        mm_sbrk(-(int)(meta_data_size + last->size));
+}
+
+void mm_reclaim(size_t bytes_wanted)
+{
+    mm_reclaim_runs++;
+    for (int i = 0; i < mm_reclaim_callback_count; i++)
+        mm_reclaim_callbacks[i].fn(bytes_wanted, mm_reclaim_callbacks[i].arg);
+    mm_combine_nearby_free();
+    mm_trim();
+    mm_short_lived_trim();
+}
+
+int mm_check_growth(size_t bytes)
+{
+    if (mm_soft_limit != 0 && !mm_reclaim_done && mm_heap_in_use() + bytes > mm_soft_limit)
+    {
+        // Allocations made by the callbacks must not start another reclaim
+        mm_reclaim_done = 1;
+        mm_reclaim(bytes);
+        return MM_GROWTH_RETRY;
+    }
+    if (mm_hard_limit != 0 && mm_heap_in_use() + bytes > mm_hard_limit)
+        return MM_GROWTH_DENIED;
+    return MM_GROWTH_OK;
+}
+
+// For growth that cannot start its search over: reclaim if needed, then apply the hard limit
+int mm_growth_allowed(size_t bytes)
+{
+    int verdict = mm_check_growth(bytes);
+    if (verdict == MM_GROWTH_RETRY)
+    {
+        verdict = mm_check_growth(bytes);
+        mm_reclaim_done = 0;
+    }
+    return verdict == MM_GROWTH_OK;
+}
+// ==== End soft and hard heap limits =======
+
+// ==== Geometric growth policy =======
+//
+// By default the heap grows by exactly what an allocation needs, so every
+// allocation at the end of the heap moves the break. mm_set_growth_policy(first,
+// max) makes it grow by at least a chunk instead, starting at first bytes and
+// doubling with every growth up to max. The surplus stays behind the new block
+// as a free block that the next allocations use, so only a handful of break moves
+// happen per million allocations. Chunks never cross the heap end or the limits.
+
+size_t mm_growth_next_chunk = 0; // 0: no growth policy
+size_t mm_growth_max_chunk = 0;
+
+void mm_set_growth_policy(size_t first_chunk, size_t max_chunk)
+{
+    mm_lock();
+    mm_growth_next_chunk = first_chunk;
+    mm_growth_max_chunk = max_chunk < first_chunk ? first_chunk : max_chunk;
+    mm_unlock();
+}
+
+size_t mm_growth_chunk(size_t needed)
+{
+    if (mm_growth_next_chunk == 0 || needed >= mm_growth_next_chunk)
+        return needed;
+
+    size_t chunk = mm_growth_next_chunk;
+    if (mm_growth_next_chunk < mm_growth_max_chunk)
+        mm_growth_next_chunk = 2 * mm_growth_next_chunk < mm_growth_max_chunk ? 2 * mm_growth_next_chunk : mm_growth_max_chunk;
+
+    size_t room = mm_heap_upper_limit() - mm_sbrk(0);
+    size_t in_use = mm_heap_in_use();
+    if (mm_soft_limit != 0 && mm_soft_limit > in_use && mm_soft_limit - in_use < room)
+        room = mm_soft_limit - in_use;
+    if (mm_hard_limit != 0 && mm_hard_limit > in_use && mm_hard_limit - in_use < room)
+        room = mm_hard_limit - in_use;
+    if (chunk > room)
+        chunk = room;
+    return chunk > needed ? chunk : needed;
+}
+// ==== End geometric growth policy =======
+
+// ==== Reserve-and-commit growable buffers =======
+//
+// mm_reserve_growable(max_size) reserves address space for a buffer of up to
+// max_size bytes in a mapping of its own, inaccessible (PROT_NONE) except for the
+// first page. mm_grow(p, size) makes more of it accessible with mprotect, so the
+// buffer grows without moving or copying and pointers into it stay valid.
+// Committed pages count towards the heap limits like dedicated mappings; the
+// buffer is released with mm_free. The MetaData holds the committed payload size:
+//
+// |--------------|
+// | Data         |
+// |--------------|
+// | MetaData     | status META_DATA_STATUS_GROWABLE
+// |--------------|
+// | GrowableHdr  |
+// |--------------| <- the reservation
+const char META_DATA_STATUS_GROWABLE = 'g';
+
+struct GrowableHeader
+{
+    size_t reserved_length;  // bytes reserved, headers included
+    size_t committed_length; // bytes accessible from the start of the reservation
+} __attribute__((__packed__));
+
+const size_t growable_header_size = sizeof(struct GrowableHeader) + sizeof(struct MetaData);
+
+struct GrowableHeader *mm_growable_header(void *p)
+{
+    return (struct GrowableHeader *)(p - growable_header_size);
+}
+
+void *mm_reserve_growable(size_t max_size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t length = (growable_header_size + max_size + page - 1) & ~(page - 1);
+    if (length < max_size)
+        return NULL; // overflows
+
+    mm_lock();
+    struct GrowableHeader *gh = NULL;
+    if (mm_growth_allowed(page))
+    {
+        gh = mmap(NULL, length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (gh != MAP_FAILED && mprotect(gh, page, PROT_READ | PROT_WRITE) != 0)
+        {
+            munmap(gh, length);
+            gh = MAP_FAILED;
+        }
+    }
+    if (gh == NULL || gh == MAP_FAILED)
+    {
+        mm_unlock();
+        return NULL;
+    }
+    gh->reserved_length = length;
+    gh->committed_length = page;
+    mm_mapped_bytes += page;
+
+    void *p = (void *)gh + growable_header_size;
+    struct MetaData *md = (struct MetaData *)(p - meta_data_size);
+    md->size = page - growable_header_size;
+    md->status = META_DATA_STATUS_GROWABLE;
+    mm_unlock();
+    return p;
+}
+
+// Commit enough of the reservation for size bytes of payload.
+// Returns 1 on success, 0 if size exceeds the reservation or the limits.
+// The caller holds mm_heap_lock.
+int mm_grow_locked(void *p, size_t size)
+{
+    struct GrowableHeader *gh = mm_growable_header(p);
+    struct MetaData *md = (struct MetaData *)(p - meta_data_size);
+    if (size <= md->size)
+        return 1;
+    if (size > gh->reserved_length - growable_header_size)
+        return 0;
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t length = (growable_header_size + size + page - 1) & ~(page - 1);
+    if (!mm_growth_allowed(length - gh->committed_length))
+        return 0;
+    if (mprotect((void *)gh + gh->committed_length, length - gh->committed_length, PROT_READ | PROT_WRITE) != 0)
+        return 0;
+    mm_mapped_bytes += length - gh->committed_length;
+    gh->committed_length = length;
+    md->size = length - growable_header_size;
+    return 1;
+}
+
+int mm_grow(void *p, size_t size)
+{
+    mm_lock();
+    int grown = mm_grow_locked(p, size);
+    mm_unlock();
+    return grown;
+}
+
+void mm_free_growable(void *p)
+{
+    struct GrowableHeader *gh = mm_growable_header(p);
+    mm_mapped_bytes -= gh->committed_length;
+    munmap(gh, gh->reserved_length);
+}
+// ==== End reserve-and-commit growable buffers =======
+
+// ==== Lifetime-hinted allocation =======
+//
+// mm_malloc_ex(size, flags) places blocks according to hints:
+//   MM_HINT_LONG_LIVED  - bottom of the heap, exactly like mm_malloc (the default)
+//   MM_HINT_SHORT_LIVED - the short-lived region, which grows down from heap_end
+//   MM_HINT_ZEROED      - the payload is filled with zero bytes
+//   MM_HINT_ALIGN(n)    - the payload address is a multiple of n (a power of two)
+//
+// Short-lived churn therefore never fragments the long-lived blocks, and the
+// unused space between heap_current_break and heap_short_lived_break stays contiguous:
+//
+// |-------------------| <------ heap_end
+// |  short-lived      |
+// |-------------------| <------ heap_short_lived_break
+// |  unused           |
+// |-------------------| <------ heap_current_break
+// |  long-lived       |
+// |-------------------| <------ heap_start
+
+#define MM_HINT_LONG_LIVED 0x1UL
+#define MM_HINT_SHORT_LIVED 0x2UL
+#define MM_HINT_ZEROED 0x4UL
+#define MM_HINT_ALIGN(n) ((unsigned long)(n) << 8)
+#define MM_HINT_ALIGNMENT(flags) ((flags) >> 8 == 0 ? 1 : (size_t)((flags) >> 8))
+
+void *mm_align_up(void *p, size_t align)
+{
+    return (void *)(((size_t)p + align - 1) & ~(align - 1));
+}
+
+// Smallest aligned payload address at or above payload that leaves either
+// no gap or a gap large enough to hold a free block in front of it
+void *mm_aligned_payload(void *payload, size_t align)
+{
+    void *aligned = mm_align_up(payload, align);
+    while (aligned != payload && (size_t)(aligned - payload) <= meta_data_size)
+        aligned += align;
+    return aligned;
+}
+
+// Turn the front of the free block md into an occupied block of size bytes with
+// an aligned payload. A leading gap is kept as a separate free block.
+// Returns NULL (and leaves md untouched) if the block is too small.
+void *mm_carve_aligned(struct MetaData *md, size_t size, size_t align)
+{
+    void *payload = (void *)md + meta_data_size;
+    void *aligned = mm_aligned_payload(payload, align);
+    if (aligned + size > payload + md->size)
+        return NULL;
+
+    if (aligned != payload)
+    {
+        struct MetaData *aligned_md = (struct MetaData *)(aligned - meta_data_size);
+        aligned_md->size = payload + md->size - aligned;
+        aligned_md->status = META_DATA_STATUS_FREE;
+        md->size = (void *)aligned_md - payload;
+        md = aligned_md;
+    }
+    mm_split_block(md, size);
+    md->status = META_DATA_STATUS_OCCUPIED;
+    return aligned;
+}
+
+// First-fit over the blocks between from and to
+void *mm_first_fit_aligned(void *from, void *to, size_t size, size_t align)
+{
+    void *cur = from;
+    while (cur < to)
+    {
+        struct MetaData *md = (struct MetaData *)cur;
+        if (mm_is_free(md) && md->size >= size)
+        {
+            void *p = mm_carve_aligned(md, size, align);
+            if (p != NULL)
+                return p;
+        }
+        cur += meta_data_size + md->size;
+    }
+    return NULL;
+}
+
+// An aligned block from the emergency reserve: take a block large enough for
+// any alignment gap and carve the aligned block out of it. The gap stays in
+// the reserve as a free block.
+void *mm_malloc_emergency_aligned(size_t size, size_t align)
+{
+    if (align <= 1)
+        return mm_malloc_emergency(size);
+    if (size > SIZE_MAX - align - 2 * meta_data_size)
+        return NULL;
+    void *p = mm_malloc_emergency(size + align + 2 * meta_data_size);
+    if (p == NULL)
+        return NULL;
+    struct MetaData *md = (struct MetaData *)(p - meta_data_size);
+    md->status = META_DATA_STATUS_FREE;
+    return mm_carve_aligned(md, size, align);
+}
+
+void *mm_malloc_aligned(size_t size, size_t align)
+{
+    void *p = mm_first_fit_aligned(heap_start, mm_sbrk(0), size, align);
+    if (p != NULL)
+        return p;
+
+    // Extend the heap with one free block that is large enough for the
+    // alignment gap, then carve the aligned block out of it
+    void *cur_heap_break = mm_sbrk(0);
+    void *aligned = mm_aligned_payload(cur_heap_break + meta_data_size, align);
+    size_t gap = aligned - cur_heap_break;
+    if (size > SIZE_MAX - gap)
+        return NULL; // overflows
+    int verdict = mm_check_growth(gap + size);
+    if (verdict == MM_GROWTH_RETRY)
+    {
+        p = mm_malloc_aligned(size, align);
+        mm_reclaim_done = 0;
+        return p;
+    }
+    if (verdict == MM_GROWTH_DENIED)
+        return NULL;
+    size_t chunk = mm_growth_chunk(gap + size);
+    if (!mm_sbrk_fits(chunk))
+        return mm_malloc_emergency_aligned(size, align);
+    void *start = mm_sbrk(chunk);
+    if (start == MAP_FAILED)
+        return mm_malloc_emergency_aligned(size, align);
+
+    struct MetaData *md = (struct MetaData *)start;
+    md->size = mm_sbrk(0) - start - meta_data_size;
+    md->status = META_DATA_STATUS_FREE;
+    return mm_carve_aligned(md, size, align);
+}
+
+void *mm_malloc_short_lived(size_t size, size_t align)
+{
+    void *limit = mm_heap_upper_limit();
+    void *p = mm_first_fit_aligned(limit, heap_end, size, align);
+    if (p != NULL)
+        return p;
+    size_t room = limit - mm_sbrk(0);
+    if (size > room || align + 2 * meta_data_size > room - size)
+        return mm_malloc_emergency_aligned(size, align);
+
+    // Grow the region downwards. A gap left above the new block must be able
+    // to hold a free block of its own.
+    void *aligned = (void *)((size_t)(limit - size) & ~(align - 1));
+    while (limit != aligned + size && (size_t)(limit - (aligned + size)) <= meta_data_size)
+        aligned -= align;
+    if (aligned - meta_data_size < mm_sbrk(0))
+        return mm_malloc_emergency_aligned(size, align);
+    int verdict = mm_check_growth(limit - (aligned - meta_data_size));
+    if (verdict == MM_GROWTH_RETRY)
+    {
+        p = mm_malloc_short_lived(size, align);
+        mm_reclaim_done = 0;
+        return p;
+    }
+    if (verdict == MM_GROWTH_DENIED)
+        return NULL;
+
+    struct MetaData *md = (struct MetaData *)(aligned - meta_data_size);
+    md->size = limit - aligned;
+    md->status = META_DATA_STATUS_FREE;
+    heap_short_lived_break = md;
+    if (mm_prefault_flags)
+        mm_prefault_advance();
+    return mm_carve_aligned(md, size, 1);
+}
+
+void *mm_malloc_ex(size_t size, unsigned long flags)
+{
+    size_t align = MM_HINT_ALIGNMENT(flags);
+    if ((align & (align - 1)) != 0)
+        return NULL; // alignment must be a power of two
+
+    void *p;
+    mm_lock();
+    if (flags & MM_HINT_SHORT_LIVED)
+        p = mm_malloc_short_lived(size, align);
+    else if (align > 1)
+        p = mm_malloc_aligned(size, align);
+    else
+        p = mm_malloc_first_fit(size);
+
+    if (p != NULL && (flags & MM_HINT_ZEROED))
+        mm_fill(p, 0, size);
+    mm_unlock();
+    return p;
+}
+// ==== End lifetime-hinted allocation =======
+
+// ==== Allocation-site lifetime prediction =======
+//
+// When enabled with mm_set_lifetime_prediction(1), mm_malloc learns per call site
+// (hash of the return address) whether its blocks tend to die young, i.e. are freed
+// within MM_LIFETIME_YOUNG_AGE further allocations. Blocks from sites predicted to be
+// short-lived go to the short-lived region (the nursery) of mm_malloc_ex, which hands
+// its space back in bulk as soon as its bottom blocks are free.
+//
+// The site table is fixed-size and lock-free: slots are claimed with a CAS and the
+// counters are relaxed atomics. Birth times of live blocks are kept in a fixed-size
+// side table; allocations that do not fit in it are simply not sampled.
+
+#define MM_LIFETIME_SITES 256             // power of two
+#define MM_LIFETIME_SITE_PROBES 8
+#define MM_LIFETIME_BLOCKS 4096           // power of two
+#define MM_LIFETIME_YOUNG_AGE 32          // in allocations
+#define MM_LIFETIME_MIN_SAMPLES 8
+#define MM_LIFETIME_DECAY_SAMPLES 1024
+
+struct LifetimeSite
+{
+    _Atomic uintptr_t site; // 0 marks an unused slot
+    _Atomic unsigned young;
+    _Atomic unsigned old;
+};
+
+struct LifetimeBlock
+{
+    void *p; // NULL marks an unused slot
+    struct LifetimeSite *site;
+    unsigned long birth;
+};
+
+int mm_lifetime_prediction_enabled = 0;
+struct LifetimeSite mm_lifetime_sites[MM_LIFETIME_SITES];
+struct LifetimeBlock mm_lifetime_blocks[MM_LIFETIME_BLOCKS];
+unsigned long mm_lifetime_clock = 0;
+
+void mm_set_lifetime_prediction(int enabled)
+{
+    mm_lock();
+    // Frees are not recorded while prediction is off, so entries left from an
+    // earlier run may name blocks that are gone and whose addresses were reused
+    if (enabled && !mm_lifetime_prediction_enabled)
+        memset(mm_lifetime_blocks, 0, sizeof(mm_lifetime_blocks));
+    mm_lifetime_prediction_enabled = enabled;
+    mm_unlock();
+}
+
+size_t mm_lifetime_hash(uintptr_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (size_t)key;
+}
+
+struct LifetimeSite *mm_lifetime_site(void *ret_addr)
+{
+    uintptr_t site = (uintptr_t)ret_addr;
+    size_t h = mm_lifetime_hash(site);
+    for (int i = 0; i < MM_LIFETIME_SITE_PROBES; i++)
+    {
+        struct LifetimeSite *s = &mm_lifetime_sites[(h + i) & (MM_LIFETIME_SITES - 1)];
+        uintptr_t cur = atomic_load_explicit(&s->site, memory_order_acquire);
+        if (cur == 0)
+        {
+            uintptr_t expected = 0;
+            if (atomic_compare_exchange_strong(&s->site, &expected, site) || expected == site)
+                return s;
+            continue;
+        }
+        if (cur == site)
+            return s;
+    }
+    return NULL; // table full around this hash: no prediction
+}
+
+int mm_lifetime_predict_short(struct LifetimeSite *s)
+{
+    unsigned young = atomic_load_explicit(&s->young, memory_order_relaxed);
+    unsigned old = atomic_load_explicit(&s->old, memory_order_relaxed);
+    return young + old >= MM_LIFETIME_MIN_SAMPLES && young >= 3 * old;
+}
+
+void mm_lifetime_record_alloc(void *p, struct LifetimeSite *s)
+{
+    size_t h = mm_lifetime_hash((uintptr_t)p);
+    for (int i = 0; i < MM_LIFETIME_BLOCKS; i++)
+    {
+        struct LifetimeBlock *b = &mm_lifetime_blocks[(h + i) & (MM_LIFETIME_BLOCKS - 1)];
+        if (b->p == NULL)
+        {
+            b->p = p;
+            b->site = s;
+            b->birth = mm_lifetime_clock;
+            return;
+        }
+        if (i >= MM_LIFETIME_SITE_PROBES)
+            return; // neighbourhood crowded: skip this sample
+    }
+}
+
+void mm_lifetime_record_free(void *p)
+{
+    size_t mask = MM_LIFETIME_BLOCKS - 1;
+    size_t i = mm_lifetime_hash((uintptr_t)p) & mask;
+    // mm_lifetime_record_alloc places a block at most MM_LIFETIME_SITE_PROBES slots
+    // from its home and backward-shift deletion only moves blocks closer to it
+    int probes = 0;
+    while (mm_lifetime_blocks[i].p != NULL && mm_lifetime_blocks[i].p != p && probes < MM_LIFETIME_SITE_PROBES)
+    {
+        i = (i + 1) & mask;
+        probes++;
+    }
+    if (mm_lifetime_blocks[i].p != p)
+        return; // not sampled
+
+    struct LifetimeSite *s = mm_lifetime_blocks[i].site;
+    if (mm_lifetime_clock - mm_lifetime_blocks[i].birth < MM_LIFETIME_YOUNG_AGE)
+        atomic_fetch_add_explicit(&s->young, 1, memory_order_relaxed);
+    else
+        atomic_fetch_add_explicit(&s->old, 1, memory_order_relaxed);
+
+    // Halve old samples now and then so that a site can change its mind
+    if (atomic_load_explicit(&s->young, memory_order_relaxed) + atomic_load_explicit(&s->old, memory_order_relaxed) > MM_LIFETIME_DECAY_SAMPLES)
+    {
+        atomic_store_explicit(&s->young, atomic_load_explicit(&s->young, memory_order_relaxed) / 2, memory_order_relaxed);
+        atomic_store_explicit(&s->old, atomic_load_explicit(&s->old, memory_order_relaxed) / 2, memory_order_relaxed);
+    }
+
+    // Backward-shift deletion keeps the linear probing chains intact. A block more
+    // than MM_LIFETIME_SITE_PROBES slots past the hole has its home after the hole
+    // and cannot move into it, so the scan stops there, even in a full table.
+    size_t hole = i;
+    size_t j = (i + 1) & mask;
+    while (mm_lifetime_blocks[j].p != NULL && ((j - hole) & mask) <= MM_LIFETIME_SITE_PROBES)
+    {
+        size_t home = mm_lifetime_hash((uintptr_t)mm_lifetime_blocks[j].p) & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask))
+        {
+            mm_lifetime_blocks[hole] = mm_lifetime_blocks[j];
+            hole = j;
+        }
+        j = (j + 1) & mask;
+    }
+    mm_lifetime_blocks[hole].p = NULL;
+}
+
+void *mm_malloc_predicted(size_t size, void *ret_addr)
+{
+    struct LifetimeSite *s = mm_lifetime_site(ret_addr);
+    void *p = NULL;
+    mm_lifetime_clock++;
+    if (s != NULL && mm_lifetime_predict_short(s))
+        p = mm_malloc_short_lived(size, 1);
+    if (p == NULL)
+        p = mm_malloc_first_fit(size);
+    if (p != NULL && s != NULL)
+        mm_lifetime_record_alloc(p, s);
+    return p;
+}
+// ==== End allocation-site lifetime prediction =======
+
+// ==== Per-tag memory accounting =======
+//
+// mm_malloc_tagged(size, tag) allocates like mm_malloc and charges the block to tag.
+// The tag lives in the status byte of the MetaData (META_DATA_STATUS_TAGGED | tag),
+// so tagged blocks cost no extra space and mm_free finds the tag without a lookup.
+//
+// Every thread adds to its own counters; mm_tag_bytes(tag) sums the counters of all
+// threads only when asked, so the allocation path never touches shared cache lines.
+// A block freed by another thread is subtracted from that thread's counters, which
+// keeps the sum right.
+
+#define MM_MAX_TAGS 64
+const char META_DATA_STATUS_TAGGED = (char)0x80;
+
+struct TagCounters
+{
+    _Atomic long bytes[MM_MAX_TAGS];
+    struct TagCounters *next;
+};
+
+_Atomic(struct TagCounters *) mm_tag_threads = NULL;
+_Thread_local struct TagCounters *mm_tag_local = NULL;
+
+void mm_tag_account(int tag, long bytes)
+{
+    struct TagCounters *c = mm_tag_local;
+    if (c == NULL)
+    {
+        // Counters of exited threads stay on the list, they still hold their totals
+        c = mmap(NULL, sizeof(struct TagCounters), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (c == MAP_FAILED)
+            return;
+        c->next = atomic_load(&mm_tag_threads);
+        while (!atomic_compare_exchange_weak(&mm_tag_threads, &c->next, c))
+            ;
+        mm_tag_local = c;
+    }
+    // Only this thread writes its counters, a relaxed load/store pair is enough
+    atomic_store_explicit(&c->bytes[tag],
+                          atomic_load_explicit(&c->bytes[tag], memory_order_relaxed) + bytes,
+                          memory_order_relaxed);
+}
+
+void *mm_malloc_tagged(size_t size, int tag)
+{
+    if (tag < 0 || tag >= MM_MAX_TAGS)
+        return NULL;
+
+    mm_lock();
+    void *p = mm_lifetime_prediction_enabled ? mm_malloc_predicted(size, __builtin_return_address(0))
+                                             : mm_malloc_first_fit(size);
+    if (p != NULL)
+    {
+        struct MetaData *md = (struct MetaData *)(p - meta_data_size);
+        if (md->status == META_DATA_STATUS_MAPPED)
+            mm_mapped_header(p)->tag = tag; // the status byte must stay 'm'
+        else
+            md->status = META_DATA_STATUS_TAGGED | tag;
+        mm_tag_account(tag, md->size);
+    }
+    mm_unlock();
+    return p;
+}
+
+// Bytes currently held by blocks with the given tag, including split leftovers
+// that were too small to become free blocks of their own
+long mm_tag_bytes(int tag)
+{
+    if (tag < 0 || tag >= MM_MAX_TAGS)
+        return 0;
+
+    long total = 0;
+    for (struct TagCounters *c = atomic_load(&mm_tag_threads); c != NULL; c = c->next)
+        total += atomic_load_explicit(&c->bytes[tag], memory_order_relaxed);
+    return total;
+}
+// ==== End per-tag memory accounting =======
+
+void *mm_malloc(size_t size)
+{
+    mm_lock();
+    void *p = mm_lifetime_prediction_enabled ? mm_malloc_predicted(size, __builtin_return_address(0))
+                                             : mm_malloc_first_fit(size);
+    mm_unlock();
+    return p;
+}
+
+// ==== Async allocation with backpressure =======
+//
+// mm_malloc_async(req, size, callback, arg) never hands NULL to its callback.
+// If the heap cannot satisfy the request now (e.g. the hard limit is reached),
+// the caller-owned req is queued and callback(p, arg) runs later, from inside the
+// mm_free that made room. The queue needs no heap memory of its own.
+// A request that could not be met even on an empty heap (larger than the heap or
+// the hard limit) is rejected up front with -1 instead, and mm_async_cancel(req)
+// takes a queued request back out, e.g. when its caller gives up or the limits change.
+//
+// Waiters are served smallest first, so a burst of frees wakes as many callers as
+// possible. A waiter passed over MM_ASYNC_MAX_BYPASS times while smaller ones were
+// served becomes a barrier: nobody else is served, and new async requests queue up
+// behind it, until it has been satisfied. This keeps large requests from starving.
+
+#define MM_ASYNC_MAX_BYPASS 4
+
+struct MMAsyncRequest
+{
+    size_t size;
+    void (*callback)(void *p, void *arg);
+    void *arg;
+    int bypassed; // passes in which a smaller waiter was served instead
+    void *p;      // the allocated block, set just before the callback runs
+    struct MMAsyncRequest *next;
+};
+
+struct MMAsyncRequest *mm_async_queue = NULL; // sorted by size, FIFO for equal sizes
+int mm_async_servicing = 0;
+int mm_async_pending = 0;
+
+struct MMAsyncRequest *mm_async_starving()
+{
+    for (struct MMAsyncRequest *r = mm_async_queue; r != NULL; r = r->next)
+        if (r->bypassed >= MM_ASYNC_MAX_BYPASS)
+            return r;
+    return NULL;
+}
+
+void mm_async_unlink(struct MMAsyncRequest *req)
+{
+    struct MMAsyncRequest **link = &mm_async_queue;
+    while (*link != req)
+        link = &(*link)->next;
+    *link = req->next;
+}
+
+void mm_async_service()
+{
+    if (mm_async_servicing)
+    {
+        // A callback freed memory: the running loop goes round once more
+        mm_async_pending = 1;
+        return;
+    }
+    mm_async_servicing = 1;
+    do
+    {
+        mm_async_pending = 0;
+        if (mm_async_queue == NULL)
+            break;
+        mm_combine_nearby_free();
+
+        // Allocate for every waiter that fits now, run callbacks afterwards
+        // so that they may queue or free without disturbing the walk
+        struct MMAsyncRequest *done = NULL;
+        struct MMAsyncRequest *starving = mm_async_starving();
+        struct MMAsyncRequest *r = starving != NULL ? starving : mm_async_queue;
+        int served = 0;
+        while (r != NULL)
+        {
+            struct MMAsyncRequest *next = starving != NULL ? NULL : r->next;
+            void *p = mm_malloc(r->size);
+            if (p != NULL)
+            {
+                mm_async_unlink(r);
+                r->p = p;
+                r->next = done;
+                done = r;
+                served = 1;
+            }
+            else if (served)
+            {
+                r->bypassed++;
+            }
+            r = next;
+        }
+        while (done != NULL)
+        {
+            struct MMAsyncRequest *next = done->next;
+            done->callback(done->p, done->arg);
+            done = next;
+        }
+    } while (mm_async_pending);
+    mm_async_servicing = 0;
+}
+
+// Whether size bytes could be allocated once every other block was freed
+int mm_async_satisfiable(size_t size)
+{
+    int mapped = mm_mmap_threshold != 0 && size >= mm_mmap_threshold;
+    size_t needed = mapped ? mm_mapped_length(size) : size + meta_data_size;
+    if (needed < size)
+        return 0; // overflows
+    if (mm_hard_limit != 0 && needed > mm_hard_limit)
+        return 0;
+    return mapped || needed <= (size_t)(heap_end - heap_start);
+}
+
+// Returns 0 when the request was served or queued, -1 when it can never be
+// served (the callback is not called then)
+int mm_malloc_async(struct MMAsyncRequest *req, size_t size, void (*callback)(void *p, void *arg), void *arg)
+{
+    req->size = size;
+    req->callback = callback;
+    req->arg = arg;
+    req->bypassed = 0;
+    req->p = NULL;
+
+    mm_lock();
+    if (!mm_async_satisfiable(size))
+    {
+        mm_unlock();
+        return -1;
+    }
+    void *p = mm_async_starving() == NULL ? mm_malloc(size) : NULL;
+    if (p == NULL)
+    {
+        struct MMAsyncRequest **link = &mm_async_queue;
+        while (*link != NULL && (*link)->size <= size)
+            link = &(*link)->next;
+        req->next = *link;
+        *link = req;
+    }
+    mm_unlock();
+
+    if (p != NULL)
+        callback(p, arg);
+    return 0;
+}
+
+// Take a queued request back out. Returns 1 if it was still waiting, 0 if it
+// was served already (its callback has run or is about to run).
+int mm_async_cancel(struct MMAsyncRequest *req)
+{
+    mm_lock();
+    int waiting = 0;
+    for (struct MMAsyncRequest *r = mm_async_queue; r != NULL; r = r->next)
+        waiting |= r == req;
+    if (waiting)
+        mm_async_unlink(req);
+    mm_unlock();
+    return waiting;
+}
+// ==== End async allocation with backpressure =======
+
+void mm_free(void *p)
+{
+    mm_lock();
+    if (mm_lifetime_prediction_enabled)
+        mm_lifetime_record_free(p);
+
+    struct MetaData *md = (struct MetaData *)(p - meta_data_size);
+    if (md->status == META_DATA_STATUS_MAPPED)
+    {
+        if (mm_mapped_header(p)->tag >= 0)
+            mm_tag_account(mm_mapped_header(p)->tag, -(long)md->size);
+        mm_free_mapped(p);
+    }
+    else if (md->status == META_DATA_STATUS_GROWABLE)
+    {
+        mm_free_growable(p);
+    }
+    else
+    {
+        if (md->status & META_DATA_STATUS_TAGGED)
+            mm_tag_account(md->status & ~META_DATA_STATUS_TAGGED, -(long)md->size);
+        if (mm_is_emergency_block(p))
+        {
+            mm_free_emergency(p);
+        }
+        else
+        {
+            md->status = META_DATA_STATUS_FREE;
+
+            // Freed short-lived blocks at the bottom of the short-lived region are
+            // given back to the free space in the middle of the heap straight away
+            if (heap_short_lived_break != NULL && p > heap_short_lived_break)
+                mm_short_lived_trim();
+        }
+    }
+
+    if (mm_async_queue != NULL)
+        mm_async_service();
+    mm_unlock();
+}
+
+// ==== Pre-zeroed pool =======
+//
+// mm_start_zeroing_worker(pool_bytes) starts a background thread that zeroes free
+// blocks while the heap is idle and marks them META_DATA_STATUS_FREE_ZEROED, until
+// pool_bytes of zeroed free space exist. mm_calloc takes such blocks first and
+// skips the memset. The worker only runs when it gets mm_heap_lock without waiting
+// and nobody took the lock since its last round, and it zeroes at most
+// MM_ZEROING_BUDGET bytes per round, splitting larger free blocks, so it never
+// holds up allocations for long. Until the worker has zeroed something, mm_calloc
+// does not look for zeroed blocks at all.
+
+#define MM_ZEROING_INTERVAL_US 1000
+#define MM_ZEROING_BUDGET (64 * 1024)
+
+pthread_t mm_zeroing_thread;
+atomic_int mm_zeroing_running = 0;
+size_t mm_zeroing_target = 0;
+unsigned long mm_calloc_calls = 0;
+unsigned long mm_calloc_pool_hits = 0;
+int mm_zeroed_blocks_exist = 0; // 0 once a pool lookup found no zeroed block at all
+
+size_t mm_zeroed_bytes_range(void *from, void *to)
+{
+    size_t bytes = 0;
+    for (void *cur = from; cur < to; cur += meta_data_size + ((struct MetaData *)cur)->size)
+        if (((struct MetaData *)cur)->status == META_DATA_STATUS_FREE_ZEROED)
+            bytes += ((struct MetaData *)cur)->size;
+    return bytes;
+}
+
+// Zero free blocks between from and to; returns the bytes zeroed, at most about budget.
+// A free block larger than the rest of the budget is split and only its front is
+// zeroed; the remainder stays free for later rounds. Zeroed pieces are merged with
+// a zeroed block right before them, so a large block is rebuilt round by round.
+size_t mm_zero_range(void *from, void *to, size_t budget)
+{
+    size_t done = 0;
+    struct MetaData *prev = NULL;
+    for (void *cur = from; cur < to && done < budget; cur += meta_data_size + ((struct MetaData *)cur)->size)
+    {
+        struct MetaData *md = (struct MetaData *)cur;
+        if (md->status == META_DATA_STATUS_FREE)
+        {
+            mm_split_block(md, budget - done);
+            mm_fill(cur + meta_data_size, 0, md->size);
+            md->status = META_DATA_STATUS_FREE_ZEROED;
+            mm_zeroed_blocks_exist = 1;
+            done += md->size;
+            if (prev != NULL && prev->status == META_DATA_STATUS_FREE_ZEROED)
+            {
+                // The header becomes part of prev's payload, so it is zeroed too
+                prev->size += meta_data_size + md->size;
+                mm_layout_changed(cur, cur + meta_data_size);
+                mm_fill(md, 0, meta_data_size);
+                md = prev;
+                cur = prev;
+            }
+        }
+        prev = md;
+    }
+    return done;
+}
+
+// The caller holds mm_heap_lock
+void mm_zeroing_round()
+{
+    size_t pool = mm_zeroed_bytes_range(heap_start, mm_sbrk(0));
+    if (heap_short_lived_break != NULL)
+        pool += mm_zeroed_bytes_range(heap_short_lived_break, heap_end);
+    if (pool >= mm_zeroing_target)
+        return;
+
+    size_t budget = mm_zeroing_target - pool < MM_ZEROING_BUDGET ? mm_zeroing_target - pool : MM_ZEROING_BUDGET;
+    size_t done = mm_zero_range(heap_start, mm_sbrk(0), budget);
+    if (heap_short_lived_break != NULL && done < budget)
+        mm_zero_range(heap_short_lived_break, heap_end, budget - done);
+}
+
+void *mm_zeroing_worker(void *arg)
+{
+    unsigned long seen_ops = 0;
+    while (atomic_load(&mm_zeroing_running))
+    {
+        usleep(MM_ZEROING_INTERVAL_US);
+        if (!mm_trylock())
+            continue;
+        if (mm_heap_ops == seen_ops && heap_start != NULL)
+            mm_zeroing_round();
+        seen_ops = mm_heap_ops;
+        mm_unlock();
+    }
+    return NULL;
+}
+
+// Returns 0 on success, -1 if the worker is running already or cannot be started
+int mm_start_zeroing_worker(size_t pool_bytes)
+{
+    if (atomic_exchange(&mm_zeroing_running, 1))
+        return -1;
+    mm_zeroing_target = pool_bytes;
+    if (pthread_create(&mm_zeroing_thread, NULL, mm_zeroing_worker, NULL) != 0)
+    {
+        atomic_store(&mm_zeroing_running, 0);
+        return -1;
+    }
+    return 0;
+}
+
+void mm_stop_zeroing_worker()
+{
+    if (atomic_exchange(&mm_zeroing_running, 0))
+        pthread_join(mm_zeroing_thread, NULL);
+}
+
+// First zeroed block that fits, or NULL. The caller holds mm_heap_lock.
+void *mm_malloc_zeroed_from_pool(size_t size)
+{
+    if (!mm_zeroed_blocks_exist)
+        return NULL;
+    int seen = 0;
+    void *regions[2][2] = {{heap_start, mm_sbrk(0)}, {heap_short_lived_break, heap_end}};
+    for (int r = 0; r < 2; r++)
+    {
+        for (void *cur = regions[r][0]; cur != NULL && cur < regions[r][1]; cur += meta_data_size + ((struct MetaData *)cur)->size)
+        {
+            struct MetaData *md = (struct MetaData *)cur;
+            if (md->status != META_DATA_STATUS_FREE_ZEROED)
+                continue;
+            seen = 1;
+            if (md->size >= size)
+            {
+                mm_split_block(md, size);
+                md->status = META_DATA_STATUS_OCCUPIED;
+                return cur + meta_data_size;
+            }
+        }
+    }
+    // The pool is used up: skip the search until the worker zeroes blocks again
+    mm_zeroed_blocks_exist = seen;
+    return NULL;
+}
+// ==== End pre-zeroed pool =======
+
+// ==== Realloc and calloc =======
+//
+// mm_realloc keeps the block where it is whenever it can: shrinking splits off the
+// tail, growing absorbs following free blocks or moves heap_current_break for the
+// last block. Dedicated mappings are resized with mremap. Only otherwise is the
+// payload copied to a new block.
+
+// Tag of an occupied block, or -1
+int mm_block_tag(void *p)
+{
+    struct MetaData *md = (struct MetaData *)(p - meta_data_size);
+    if (md->status == META_DATA_STATUS_MAPPED)
+        return mm_mapped_header(p)->tag;
+    if (md->status & META_DATA_STATUS_TAGGED)
+        return md->status & ~META_DATA_STATUS_TAGGED;
+    return -1;
+}
+
+// Grow the heap block md to at least size bytes without moving it.
+// Returns 1 on success, 0 if the block was left unchanged.
+int mm_expand_in_place(struct MetaData *md, size_t size)
+{
+    int short_lived = (void *)md >= mm_heap_upper_limit();
+    void *region_end = short_lived ? heap_end : mm_sbrk(0);
+    void *next = (void *)md + meta_data_size + md->size;
+
+    // Free blocks right after md, even if they have not been combined yet
+    size_t available = md->size;
+    void *cur = next;
+    while (cur < region_end && mm_is_free((struct MetaData *)cur) && available < size)
+    {
+        available += meta_data_size + ((struct MetaData *)cur)->size;
+        cur += meta_data_size + ((struct MetaData *)cur)->size;
+    }
+
+    if (available < size)
+    {
+        // The last block of the bottom region can take the space above the break
+        if (short_lived || cur != region_end)
+            return 0;
+        int verdict = mm_check_growth(size - available);
+        if (verdict == MM_GROWTH_RETRY)
+        {
+            // The reclaim combined free blocks and may have trimmed the break,
+            // so available and cur are stale: scan again
+            int expanded = mm_expand_in_place(md, size);
+            mm_reclaim_done = 0;
+            return expanded;
+        }
+        if (verdict == MM_GROWTH_DENIED)
+            return 0;
+        if (!mm_sbrk_fits(size - available) || mm_sbrk(size - available) == MAP_FAILED)
+            return 0;
+        mm_layout_changed(next, cur); // md takes in the free blocks after it
+        md->size = size;
+        return 1;
+    }
+
+    mm_layout_changed(next, cur);
+    md->size = available;
+    mm_split_block(md, size);
+    return 1;
+}
+
+// Resize a mapped block in place or let the kernel move it.
+// Returns the new payload address or NULL (the block is left unchanged).
+void *mm_realloc_mapped(void *p, size_t size)
+{
+    struct MappedHeader *mh = mm_mapped_header(p);
+    size_t offset = mh->color_offset;
+    size_t old_length = mh->map_length;
+    size_t length = mm_mapped_length(offset + size);
+    if (length < size)
+        return NULL; // overflows
+    if (length > old_length && !mm_growth_allowed(length - old_length))
+        return NULL;
+
+    if (length != old_length)
+    {
+        void *start = mremap(mm_mapping_start(mh), old_length, length, MREMAP_MAYMOVE);
+        if (start == MAP_FAILED)
+            return NULL;
+        mh = start + offset;
+        mh->map_length = length;
+        mm_mapped_bytes += length - old_length;
+    }
+    p = (void *)mh + mapped_header_size;
+    ((struct MetaData *)(p - meta_data_size))->size = size;
+    return p;
+}
+
+// The caller holds mm_heap_lock
+void *mm_realloc_locked(void *p, size_t size)
+{
+    if (p == NULL)
+        return mm_malloc(size);
+    if (size == 0)
+    {
+        mm_free(p);
+        return NULL;
+    }
+
+    struct MetaData *md = (struct MetaData *)(p - meta_data_size);
+    size_t old_size = md->size;
+    int tag = mm_block_tag(p);
+
+    void *q = NULL;
+    if (md->status == META_DATA_STATUS_GROWABLE)
+        q = mm_grow_locked(p, size) ? p : NULL;
+    else if (md->status == META_DATA_STATUS_MAPPED && mm_mmap_threshold != 0 && size >= mm_mmap_threshold)
+        q = mm_realloc_mapped(p, size);
+    else if (md->status != META_DATA_STATUS_MAPPED &&
+             (size <= md->size || (!mm_is_emergency_block(p) && mm_expand_in_place(md, size))))
+    {
+        mm_split_block(md, size);
+        q = p;
+    }
+    if (q != NULL)
+    {
+        if (tag >= 0)
+            mm_tag_account(tag, (long)((struct MetaData *)(q - meta_data_size))->size - (long)old_size);
+        return q;
+    }
+
+    q = tag >= 0 ? mm_malloc_tagged(size, tag) : mm_malloc(size);
+    if (q == NULL)
+        return NULL;
+    mm_copy(q, p, old_size < size ? old_size : size);
+    mm_free(p);
+    return q;
+}
+
+void *mm_realloc(void *p, size_t size)
+{
+    mm_lock();
+    void *q = mm_realloc_locked(p, size);
+    mm_unlock();
+    return q;
+}
+
+void *mm_calloc(size_t count, size_t size)
+{
+    if (size != 0 && count > (size_t)-1 / size)
+        return NULL; // count * size overflows
+
+    mm_lock();
+    mm_calloc_calls++;
+    void *p = NULL;
+    if (mm_mmap_threshold == 0 || count * size < mm_mmap_threshold)
+        p = mm_malloc_zeroed_from_pool(count * size);
+    if (p != NULL)
+    {
+        mm_calloc_pool_hits++;
+    }
+    else
+    {
+        p = mm_malloc(count * size);
+        // Fresh dedicated mappings are zero already
+        if (p != NULL && ((struct MetaData *)(p - meta_data_size))->status != META_DATA_STATUS_MAPPED)
+            mm_fill(p, 0, count * size);
+    }
+    mm_unlock();
+    return p;
+}
+// ==== End realloc and calloc =======
+
+// ==== Usable sizes and in-place expansion =======
+//
+// A block often holds more than was asked for: mm_split_block leaves a remainder
+// too small for another MetaData with the block, and dedicated mappings are
+// rounded up to whole pages. mm_malloc_sized() returns that usable size with the
+// pointer so growable containers can use the slack, and mm_try_expand() grows a
+// block only when it can stay where it is, never copying.
+struct MMSizedPtr
+{
+    void *p;
+    size_t usable_size;
+};
+
+// Usable bytes of the occupied block p; for dedicated mappings, up to the end of the mapping
+size_t mm_usable_size(void *p)
+{
+    struct MetaData *md = (struct MetaData *)(p - meta_data_size);
+    if (md->status == META_DATA_STATUS_MAPPED)
+        return mm_mapped_capacity(mm_mapped_header(p));
+    return md->size; // growable buffers: the committed part
+}
+
+struct MMSizedPtr mm_malloc_sized(size_t size)
+{
+    struct MMSizedPtr r = {NULL, 0};
+    mm_lock();
+    r.p = mm_malloc(size);
+    if (r.p != NULL)
+    {
+        // Record the slack of a mapping as part of the block, so a later
+        // mm_realloc copies it along
+        r.usable_size = mm_usable_size(r.p);
+        ((struct MetaData *)(r.p - meta_data_size))->size = r.usable_size;
+    }
+    mm_unlock();
+    return r;
+}
+
+// Grow the block p to at least new_size bytes without moving it.
+// Returns 1 on success (or if it already holds new_size bytes), 0 if it was left unchanged.
+int mm_try_expand(void *p, size_t new_size)
+{
+    mm_lock();
+    struct MetaData *md = (struct MetaData *)(p - meta_data_size);
+    size_t old_size = md->size;
+    int expanded = 1;
+    if (md->status == META_DATA_STATUS_GROWABLE)
+    {
+        expanded = mm_grow_locked(p, new_size);
+    }
+    else if (new_size > md->size && md->status == META_DATA_STATUS_MAPPED)
+    {
+        // mremap without MREMAP_MAYMOVE fails rather than move the mapping
+        struct MappedHeader *mh = mm_mapped_header(p);
+        size_t length = mm_mapped_length(mh->color_offset + new_size);
+        if (length < new_size)
+        {
+            expanded = 0; // overflows
+        }
+        else if (length > mh->map_length)
+        {
+            if (!mm_growth_allowed(length - mh->map_length) ||
+                mremap(mm_mapping_start(mh), mh->map_length, length, 0) == MAP_FAILED)
+                expanded = 0;
+            else
+            {
+                mm_mapped_bytes += length - mh->map_length;
+                mh->map_length = length;
+            }
+        }
+        if (expanded)
+            md->size = mm_mapped_capacity(mh);
+        expanded = md->size >= new_size;
+    }
+    else if (new_size > md->size)
+    {
+        expanded = !mm_is_emergency_block(p) && mm_expand_in_place(md, new_size);
+    }
+
+    int tag = mm_block_tag(p);
+    if (tag >= 0 && md->size != old_size)
+        mm_tag_account(tag, (long)md->size - (long)old_size);
+    mm_unlock();
+    return expanded;
+}
+// ==== End usable sizes and in-place expansion =======
+
+// ==== Aligned I/O buffer pools =======
+//
+// mm_io_pool_create(buffer_size, align) hands out buffers whose address and length
+// are multiples of align (the page size by default, at least a 512-byte sector),
+// as O_DIRECT reads and writes require, so callers no longer over-allocate and
+// copy to get there. Buffers are reference counted: mm_io_slice() makes a
+// zero-copy view of part of a buffer that holds its own reference, and
+// mm_io_slice_iovec() turns it into an iovec for preadv/pwritev/vmsplice. The
+// buffer goes back to the pool when the last reference is dropped.
+//
+// Each thread keeps up to MM_IO_CACHED_BUFFERS free buffers per pool on a list of
+// its own, so recycling a buffer does not take mm_heap_lock; beyond that buffers
+// are returned with mm_free. The MMIOBuffer sits right after the data, which keeps
+// the data aligned:
+//
+// |--------------|
+// | MMIOBuffer   |
+// |--------------| <- data + capacity
+// | Data         |
+// |--------------| <- data, a multiple of align
+// | MetaData     |
+// |--------------|
+//
+// At most MM_MAX_IO_POOLS pools exist at a time; mm_io_pool_destroy() gives the
+// pool's id back for the next mm_io_pool_create().
+
+#define MM_MAX_IO_POOLS 16
+#define MM_IO_CACHED_BUFFERS 32
+#define MM_IO_SECTOR_SIZE 512
+
+struct MMIOPool
+{
+    int id;
+    size_t buffer_size; // a multiple of align
+    size_t align;
+};
+
+struct MMIOBuffer
+{
+    void *data;
+    size_t capacity;
+    atomic_int refs;
+    struct MMIOPool *pool;
+    struct MMIOBuffer *next; // on a thread's free list
+};
+
+struct MMIOSlice
+{
+    struct MMIOBuffer *buffer;
+    size_t offset;
+    size_t length;
+};
+
+struct IOFreeLists
+{
+    struct MMIOBuffer *head[MM_MAX_IO_POOLS];
+    int count[MM_MAX_IO_POOLS];
+    struct IOFreeLists *next;
+};
+
+atomic_uint mm_io_pool_ids = 0; // bit i is set while pool id i is in use
+_Atomic(struct IOFreeLists *) mm_io_threads = NULL;
+_Thread_local struct IOFreeLists *mm_io_local = NULL;
+
+// The calling thread's free lists, NULL if they cannot be created
+struct IOFreeLists *mm_io_free_lists()
+{
+    struct IOFreeLists *l = mm_io_local;
+    if (l == NULL)
+    {
+        // Lists of exited threads stay registered so mm_io_pool_destroy finds their buffers
+        l = mmap(NULL, sizeof(struct IOFreeLists), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (l == MAP_FAILED)
+            return NULL;
+        l->next = atomic_load(&mm_io_threads);
+        while (!atomic_compare_exchange_weak(&mm_io_threads, &l->next, l))
+            ;
+        mm_io_local = l;
+    }
+    return l;
+}
+
+struct MMIOPool *mm_io_pool_create(size_t buffer_size, size_t align)
+{
+    if (align == 0)
+        align = sysconf(_SC_PAGESIZE);
+    if ((align & (align - 1)) != 0 || align < MM_IO_SECTOR_SIZE)
+        return NULL;
+    // Claim the lowest free id
+    unsigned ids = atomic_load(&mm_io_pool_ids);
+    int id;
+    do
+    {
+        if (ids == (1u << MM_MAX_IO_POOLS) - 1)
+            return NULL;
+        id = __builtin_ctz(~ids);
+    } while (!atomic_compare_exchange_weak(&mm_io_pool_ids, &ids, ids | 1u << id));
+
+    struct MMIOPool *pool = mm_malloc(sizeof(struct MMIOPool));
+    if (pool == NULL)
+    {
+        atomic_fetch_and(&mm_io_pool_ids, ~(1u << id));
+        return NULL;
+    }
+    pool->id = id;
+    pool->buffer_size = (buffer_size + align - 1) & ~(align - 1);
+    pool->align = align;
+    return pool;
+}
+
+// A buffer with one reference, NULL if the heap is full
+struct MMIOBuffer *mm_io_buffer_get(struct MMIOPool *pool)
+{
+    struct IOFreeLists *l = mm_io_free_lists();
+    struct MMIOBuffer *b = NULL;
+    if (l != NULL && l->head[pool->id] != NULL)
+    {
+        b = l->head[pool->id];
+        l->head[pool->id] = b->next;
+        l->count[pool->id]--;
+    }
+    else
+    {
+        void *data = mm_malloc_ex(pool->buffer_size + sizeof(struct MMIOBuffer), MM_HINT_ALIGN(pool->align));
+        if (data == NULL)
+            return NULL;
+        b = data + pool->buffer_size;
+        b->data = data;
+        b->capacity = pool->buffer_size;
+        b->pool = pool;
+    }
+    atomic_init(&b->refs, 1);
+    return b;
+}
+
+void mm_io_buffer_ref(struct MMIOBuffer *b)
+{
+    atomic_fetch_add_explicit(&b->refs, 1, memory_order_relaxed);
+}
+
+// Drop a reference; the last one returns the buffer to the calling thread's list
+void mm_io_buffer_put(struct MMIOBuffer *b)
+{
+    if (atomic_fetch_sub_explicit(&b->refs, 1, memory_order_acq_rel) != 1)
+        return;
+    int id = b->pool->id;
+    struct IOFreeLists *l = mm_io_free_lists();
+    if (l == NULL || l->count[id] == MM_IO_CACHED_BUFFERS)
+    {
+        mm_free(b->data);
+        return;
+    }
+    b->next = l->head[id];
+    l->head[id] = b;
+    l->count[id]++;
+}
+
+// A view of length bytes at offset in b, holding a reference to b
+struct MMIOSlice mm_io_slice(struct MMIOBuffer *b, size_t offset, size_t length)
+{
+    struct MMIOSlice slice = {NULL, 0, 0};
+    if (offset > b->capacity || length > b->capacity - offset)
+        return slice;
+    mm_io_buffer_ref(b);
+    slice.buffer = b;
+    slice.offset = offset;
+    slice.length = length;
+    return slice;
+}
+
+void mm_io_slice_release(struct MMIOSlice slice)
+{
+    if (slice.buffer != NULL)
+        mm_io_buffer_put(slice.buffer);
+}
+
+struct iovec mm_io_slice_iovec(struct MMIOSlice slice)
+{
+    struct iovec v = {slice.buffer->data + slice.offset, slice.length};
+    return v;
+}
+
+// Free the pool and the buffers cached by every thread. All buffers must have
+// been put back, and no thread may use the pool any more.
+void mm_io_pool_destroy(struct MMIOPool *pool)
+{
+    for (struct IOFreeLists *l = atomic_load(&mm_io_threads); l != NULL; l = l->next)
+    {
+        while (l->head[pool->id] != NULL)
+        {
+            struct MMIOBuffer *b = l->head[pool->id];
+            l->head[pool->id] = b->next;
+            mm_free(b->data);
+        }
+        l->count[pool->id] = 0;
+    }
+    atomic_fetch_and(&mm_io_pool_ids, ~(1u << pool->id));
+    mm_free(pool);
+}
+// ==== End aligned I/O buffer pools =======
+
+// ==== Heap statistics =======
+//
+// mm_get_stats() summarises the layout printed by mm_print().
+// The unused space between the two regions counts as one free extent, so
+// fragmentation = 1 - (largest free extent / all free bytes) is 0 when all
+// free space is in one piece and approaches 1 as it is scattered.
+struct MMStats
+{
+    size_t heap_size;          // heap_end - heap_start
+    size_t occupied_bytes;     // payload bytes of occupied blocks
+    size_t free_bytes;         // payload bytes of free blocks plus the unused space
+    size_t largest_free_block; // largest free block or unused extent, in bytes
+    int occupied_blocks;
+    int free_blocks;
+    double fragmentation;
+    unsigned long reclaim_runs; // times the soft limit triggered a reclaim
+    size_t zeroed_pool_bytes;   // free bytes known to be zero (part of free_bytes)
+    unsigned long calloc_calls;
+    unsigned long calloc_pool_hits; // mm_calloc calls served from the zeroed pool
+    unsigned long break_moves;      // times mm_sbrk moved heap_current_break
+    unsigned long max_scan_length;  // most blocks one mm_malloc search looked at
+    unsigned long emergency_allocs; // allocations served from the emergency reserve
+    unsigned long lock_acquisitions;     // outermost mm_heap_lock acquisitions
+    unsigned long lock_contended;        // of those, the ones that had to wait
+    unsigned long long lock_wait_ns;     // total time spent waiting for mm_heap_lock
+    unsigned long long lock_max_wait_ns; // longest single wait
+    unsigned long long lock_hold_ns;     // total time mm_heap_lock was held
+};
+
+void mm_stats_range(void *from, void *to, struct MMStats *st)
+{
+    void *cur = from;
+    while (cur < to)
+    {
+        struct MetaData *md = (struct MetaData *)cur;
+        if (mm_is_free(md))
+        {
+            st->free_blocks++;
+            st->free_bytes += md->size;
+            if (md->status == META_DATA_STATUS_FREE_ZEROED)
+                st->zeroed_pool_bytes += md->size;
+            if (md->size > st->largest_free_block)
+                st->largest_free_block = md->size;
+        }
+        else
+        {
+            st->occupied_blocks++;
+            st->occupied_bytes += md->size;
+        }
+        cur += meta_data_size + md->size;
+    }
+}
+
+void mm_get_stats(struct MMStats *st)
+{
+    mm_lock();
+    memset(st, 0, sizeof(*st));
+    st->heap_size = heap_end - heap_start;
+    mm_stats_range(heap_start, mm_sbrk(0), st);
+    if (heap_short_lived_break != NULL)
+        mm_stats_range(heap_short_lived_break, heap_end, st);
+
+    size_t unused = mm_heap_upper_limit() - mm_sbrk(0);
+    st->free_bytes += unused;
+    if (unused > st->largest_free_block)
+        st->largest_free_block = unused;
+
+    st->fragmentation = st->free_bytes == 0 ? 0.0 : 1.0 - (double)st->largest_free_block / st->free_bytes;
+    st->reclaim_runs = mm_reclaim_runs;
+    st->calloc_calls = mm_calloc_calls;
+    st->calloc_pool_hits = mm_calloc_pool_hits;
+    st->break_moves = mm_break_moves;
+    st->max_scan_length = mm_max_scan_length;
+    st->emergency_allocs = mm_emergency_allocs;
+    // Figures up to this call, whose own hold is still running
+    st->lock_acquisitions = mm_heap_lock.acquisitions;
+    st->lock_contended = mm_heap_lock.contended;
+    st->lock_wait_ns = mm_heap_lock.wait_ns;
+    st->lock_max_wait_ns = mm_heap_lock.max_wait_ns;
+    st->lock_hold_ns = mm_heap_lock.hold_ns;
+    mm_unlock();
+}
+// ==== End heap statistics =======
+
+// ==== Heap walk =======
+//
+// mm_heap_walk(filter, callback, arg) calls callback once per heap block that
+// passes filter, first for the bottom region and then for the short-lived
+// region, while other threads keep allocating. The heap is visited in segments
+// of MM_WALK_SEGMENT blocks: the walk holds mm_heap_lock only while it copies one
+// segment into a local batch, and runs the callbacks for the batch without the
+// lock, so callbacks may allocate and free too.
+//
+// The walk remembers where each of its last MM_WALK_ANCHORS segments ended,
+// together with the layout version of that address (see mm_layout_changed).
+// Allocating and freeing leave those versions alone, so it normally continues
+// from the block where it stopped. If merges or trims touched that block's
+// granule, it resumes from the newest anchor whose granule is untouched, and
+// from the start of the region only if there is none, skipping the blocks below
+// the highest address it has reported. Changes elsewhere in the heap do not
+// disturb it, and the lock is never held for more than one segment. Each block
+// is therefore reported at most once, in the shape it had when its segment was
+// copied; blocks that change during the walk may be missed. Dedicated mappings and growable buffers are not part of the heap
+// and are not reported. A nonzero return from the callback stops the walk.
+
+#define MM_WALK_SEGMENT 64
+#define MM_WALK_ANCHORS 16
+
+struct MMWalkAnchor
+{
+    void *at;              // a block start
+    unsigned long version; // *mm_layout_slot(at) when it was recorded
+};
+
+struct MMWalkFilter
+{
+    int free_only;   // only free blocks
+    size_t min_size; // payload sizes from min_size ...
+    size_t max_size; // ... up to max_size; 0 means no upper bound
+    int tag;         // only blocks of this mm_malloc_tagged tag; -1 for any
+};
+
+struct MMBlockInfo
+{
+    void *payload;
+    size_t size;
+    int is_free;
+    int tag;         // -1 for untagged and free blocks
+    int short_lived; // in the short-lived region
+};
+
+int mm_walk_matches(const struct MMWalkFilter *filter, struct MMBlockInfo *info)
+{
+    if (filter == NULL)
+        return 1;
+    if (filter->free_only && !info->is_free)
+        return 0;
+    if (info->size < filter->min_size || (filter->max_size != 0 && info->size > filter->max_size))
+        return 0;
+    return filter->tag < 0 || filter->tag == info->tag;
+}
+
+// Returns the number of blocks passed to callback
+int mm_heap_walk(const struct MMWalkFilter *filter, int (*callback)(const struct MMBlockInfo *info, void *arg), void *arg)
+{
+    struct MMBlockInfo batch[MM_WALK_SEGMENT];
+    int reported = 0;
+    int short_lived = 0; // the region being walked
+    void *cursor = NULL; // blocks below this address have been reported
+    struct MMWalkAnchor anchors[MM_WALK_ANCHORS];
+    int anchor_count = 0; // anchors[anchor_count % MM_WALK_ANCHORS] is the next to replace
+
+    for (;;)
+    {
+        mm_lock();
+        void *from = short_lived ? heap_short_lived_break : heap_start;
+        void *to = short_lived ? heap_end : mm_sbrk(0);
+        if (from == NULL)
+            from = to; // no short-lived region
+        void *cur = from;
+        for (int i = 1; i <= MM_WALK_ANCHORS && i <= anchor_count; i++)
+        {
+            struct MMWalkAnchor *a = &anchors[(anchor_count - i) % MM_WALK_ANCHORS];
+            if (a->at >= from && a->at < to && *mm_layout_slot(a->at) == a->version)
+            {
+                cur = a->at;
+                break;
+            }
+        }
+
+        int count = 0;
+        for (int visited = 0; visited < MM_WALK_SEGMENT && cur < to; visited++)
+        {
+            struct MetaData *md = (struct MetaData *)cur;
+            if (cur < cursor)
+            {
+                cur += meta_data_size + md->size; // reported before the layout changed
+                continue;
+            }
+            struct MMBlockInfo *info = &batch[count];
+            info->payload = cur + meta_data_size;
+            info->size = md->size;
+            info->is_free = mm_is_free(md);
+            info->tag = info->is_free ? -1 : mm_block_tag(info->payload);
+            info->short_lived = short_lived;
+            if (mm_walk_matches(filter, info))
+                count++;
+            cur += meta_data_size + md->size;
+            cursor = cur;
+        }
+        int region_done = cur >= to;
+        if (!region_done)
+        {
+            anchors[anchor_count % MM_WALK_ANCHORS].at = cur;
+            anchors[anchor_count % MM_WALK_ANCHORS].version = *mm_layout_slot(cur);
+            anchor_count++;
+        }
+        mm_unlock();
+
+        for (int i = 0; i < count; i++)
+        {
+            reported++;
+            if (callback(&batch[i], arg))
+                return reported;
+        }
+
+        if (region_done && !short_lived)
+        {
+            short_lived = 1;
+            anchor_count = 0;
+            cursor = NULL;
+        }
+        else if (region_done)
+        {
+            return reported;
+        }
+    }
+}
+// ==== End heap walk =======
+
+// ==== Checkpoints =======
+//
+// mm_checkpoint_save writes everything needed to continue a trace replay from
+// the current operation: the replay position, both breaks, the heap image (which
+// holds all MetaData, so the free blocks come back with it) and a handle table
+// stored as offsets from heap_start. mm_checkpoint_load restores it into a heap
+// of the same size, wherever that heap is mapped, and rebuilds the tag counters.
+// The lifetime prediction tables are heuristics and start empty again.
+// Dedicated mappings are not saved: checkpointing fails while any exist.
+
+const char MM_CHECKPOINT_MAGIC[8] = "SMMCKPT";
+
+struct CheckpointHeader
+{
+    char magic[8];
+    long position; // index of the next operation to replay
+    size_t heap_size;
+    size_t break_offset;       // heap_current_break - heap_start
+    size_t short_lived_offset; // heap_short_lived_break - heap_start
+    int handle_count;
+};
+
+// Returns 0 on success, -1 on failure
+int mm_checkpoint_save(FILE *f, long position, void **handles, int handle_count)
+{
+    mm_lock();
+    struct CheckpointHeader h;
+    memcpy(h.magic, MM_CHECKPOINT_MAGIC, sizeof(h.magic));
+    h.position = position;
+    h.heap_size = heap_end - heap_start;
+    h.break_offset = mm_sbrk(0) - heap_start;
+    h.short_lived_offset = mm_heap_upper_limit() - heap_start;
+    h.handle_count = handle_count;
+
+    int ok = mm_mapped_bytes == 0 && fwrite(&h, sizeof(h), 1, f) == 1;
+    for (int i = 0; ok && i < handle_count; i++)
+    {
+        long offset = handles[i] == NULL ? -1 : handles[i] - heap_start;
+        ok = fwrite(&offset, sizeof(offset), 1, f) == 1;
+    }
+    ok = ok && fwrite(heap_start, h.heap_size, 1, f) == 1;
+    mm_unlock();
+    return ok ? 0 : -1;
+}
+
+void mm_tag_recount_range(void *from, void *to)
+{
+    for (void *cur = from; cur < to; cur += meta_data_size + ((struct MetaData *)cur)->size)
+    {
+        struct MetaData *md = (struct MetaData *)cur;
+        if (md->status & META_DATA_STATUS_TAGGED)
+            mm_tag_account(md->status & ~META_DATA_STATUS_TAGGED, md->size);
+    }
+}
+
+// Whether a saved handle offset is NULL (-1) or points at a block in the saved
+// main or short-lived region
+int mm_checkpoint_offset_valid(const struct CheckpointHeader *h, long offset)
+{
+    if (offset == -1)
+        return 1;
+    if (offset < (long)meta_data_size)
+        return 0;
+    return (size_t)offset <= h->break_offset ||
+           ((size_t)offset >= h->short_lived_offset + meta_data_size && (size_t)offset <= h->heap_size);
+}
+
+// Restores a checkpoint into the current heap; *position receives the replay position.
+// Returns 0 on success, -1 if the file is not a checkpoint of a heap of this size.
+// The header and handle table are checked before anything in the heap changes.
+int mm_checkpoint_load(FILE *f, long *position, void **handles, int handle_count)
+{
+    struct CheckpointHeader h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, MM_CHECKPOINT_MAGIC, sizeof(h.magic)) != 0 ||
+        h.heap_size != (size_t)(heap_end - heap_start) || h.handle_count != handle_count || h.position < 0 ||
+        h.break_offset > h.short_lived_offset || h.short_lived_offset > h.heap_size)
+        return -1;
+
+    long offsets[handle_count > 0 ? handle_count : 1];
+    if (handle_count > 0 && fread(offsets, sizeof(long), handle_count, f) != (size_t)handle_count)
+        return -1;
+    for (int i = 0; i < handle_count; i++)
+    {
+        if (!mm_checkpoint_offset_valid(&h, offsets[i]))
+            return -1;
+    }
+
+    mm_lock();
+    // Move the break first: with the short-lived region dropped it may go anywhere in the heap
+    void *old_short_lived_break = heap_short_lived_break;
+    heap_short_lived_break = NULL;
+    long move = (long)h.break_offset - (mm_sbrk(0) - heap_start);
+    if (move < INT_MIN || move > INT_MAX || mm_sbrk((int)move) == MAP_FAILED)
+    {
+        heap_short_lived_break = old_short_lived_break;
+        mm_unlock();
+        return -1;
+    }
+
+    int ok = fread(heap_start, h.heap_size, 1, f) == 1;
+    mm_layout_changed(heap_start, heap_end);
+    mm_zeroed_blocks_exist = 1; // the image may hold zeroed blocks
+    heap_short_lived_break = h.short_lived_offset == h.heap_size ? NULL : heap_start + h.short_lived_offset;
+    if (ok)
+    {
+        for (int i = 0; i < handle_count; i++)
+            handles[i] = offsets[i] < 0 ? NULL : heap_start + offsets[i];
+        *position = h.position;
+
+        mm_tag_recount_range(heap_start, mm_sbrk(0));
+        if (heap_short_lived_break != NULL)
+            mm_tag_recount_range(heap_short_lived_break, heap_end);
+    }
+    mm_unlock();
+    return ok ? 0 : -1;
+}
+// ==== End checkpoints =======
+
+// ==== Metadata-only simulator =======
+//
+// sim_malloc, sim_free and sim_combine_nearby_free run the placement logic of
+// mm_malloc, mm_free and mm_combine_nearby_free (first fit or best fit, splitting
+// with enoughToSplit, growing or extending the last block, dedicated mappings above
+// mm_mmap_threshold, failure at the heap end) on block descriptors instead of real
+// MetaData. There is no heap memory behind it: nothing is written to payloads and
+// no page is ever touched. sim_print prints exactly what mm_print would, and
+// sim_get_stats fills the layout fields of struct MMStats.
+//
+// The descriptors form a treap in address order (a binary search tree kept
+// balanced by random priorities), and every node records the largest free block
+// in its subtree, so first fit walks down to the lowest-addressed free block that
+// is large enough in O(log n) instead of scanning every block. Free blocks are
+// also kept in a second treap ordered by size and then address, where best fit
+// finds the smallest fitting block in O(log n). Descriptors come from a pool that
+// grows in chunks of SIM_CHUNK_BLOCKS, so the model costs no malloc per block.
+//
+// The optional modes (hints, lifetime prediction, limits, growth policy, zeroing,
+// coloring) are not simulated. The simulated heap has the same size as the real one.
+
+#define SIM_CHUNK_BLOCKS 4096
+#define SIM_BY_ADDRESS 0 // all heap blocks
+#define SIM_BY_SIZE 1    // free heap blocks
+
+struct SimBlock
+{
+    size_t offset; // of the MetaData from heap_start
+    size_t size;
+    int is_free;
+    int is_mapped;   // dedicated mapping: not part of the simulated heap
+    unsigned priority;
+    size_t max_room; // largest free size + 1 in the address subtree, 0 if none is free
+    struct SimBlock *left[2], *right[2], *parent[2]; // per tree
+};
+
+struct SimChunk
+{
+    struct SimChunk *next;
+    struct SimBlock blocks[SIM_CHUNK_BLOCKS];
+};
+
+struct SimBlock *sim_root[2] = {NULL, NULL};
+struct SimBlock *sim_tail = NULL;   // the block at the highest address
+struct SimBlock *sim_unused = NULL; // recycled descriptors, linked through right[0]
+struct SimChunk *sim_chunks = NULL;
+int sim_chunk_used = SIM_CHUNK_BLOCKS;
+unsigned sim_seed = 2463534242u;
+size_t sim_heap_used = 0; // heap_current_break - heap_start of the simulated heap
+size_t sim_heap_size = 0;
+unsigned long sim_break_moves = 0;
+
+void sim_init(size_t heap_size)
+{
+    while (sim_chunks != NULL)
+    {
+        struct SimChunk *next = sim_chunks->next;
+        free(sim_chunks);
+        sim_chunks = next;
+    }
+    sim_chunk_used = SIM_CHUNK_BLOCKS;
+    sim_root[SIM_BY_ADDRESS] = sim_root[SIM_BY_SIZE] = NULL;
+    sim_tail = NULL;
+    sim_unused = NULL;
+    sim_heap_used = 0;
+    sim_heap_size = heap_size;
+    sim_break_moves = 0;
+}
+
+struct SimBlock *sim_new_block(size_t offset, size_t size)
+{
+    struct SimBlock *b = sim_unused;
+    if (b != NULL)
+    {
+        sim_unused = b->right[0];
+    }
+    else
+    {
+        if (sim_chunk_used == SIM_CHUNK_BLOCKS)
+        {
+            struct SimChunk *chunk = malloc(sizeof(struct SimChunk));
+            if (chunk == NULL)
+            {
+                printf("Error in allocating simulator blocks\n");
+                exit(-1);
+            }
+            chunk->next = sim_chunks;
+            sim_chunks = chunk;
+            sim_chunk_used = 0;
+        }
+        b = &sim_chunks->blocks[sim_chunk_used++];
+    }
+    memset(b, 0, sizeof(*b));
+    sim_seed ^= sim_seed << 13;
+    sim_seed ^= sim_seed >> 17;
+    sim_seed ^= sim_seed << 5;
+    b->offset = offset;
+    b->size = size;
+    b->priority = sim_seed;
+    return b;
+}
+
+void sim_release_block(struct SimBlock *b)
+{
+    b->right[0] = sim_unused;
+    sim_unused = b;
+}
+
+void sim_update(struct SimBlock *b, int t)
+{
+    if (t != SIM_BY_ADDRESS)
+        return;
+    size_t room = b->is_free ? b->size + 1 : 0;
+    if (b->left[t] != NULL && b->left[t]->max_room > room)
+        room = b->left[t]->max_room;
+    if (b->right[t] != NULL && b->right[t]->max_room > room)
+        room = b->right[t]->max_room;
+    b->max_room = room;
+}
+
+// Recompute max_room from b up to the root after b changed
+void sim_update_path(struct SimBlock *b)
+{
+    for (; b != NULL; b = b->parent[SIM_BY_ADDRESS])
+        sim_update(b, SIM_BY_ADDRESS);
+}
+
+// Point whatever pointed to old in tree t (its parent or the root) at new
+void sim_replace_child(struct SimBlock *parent, struct SimBlock *old, struct SimBlock *new, int t)
+{
+    if (parent == NULL)
+        sim_root[t] = new;
+    else if (parent->left[t] == old)
+        parent->left[t] = new;
+    else
+        parent->right[t] = new;
+    if (new != NULL)
+        new->parent[t] = parent;
+}
+
+// Rotate b above its parent in tree t, keeping the order
+void sim_rotate_up(struct SimBlock *b, int t)
+{
+    struct SimBlock *p = b->parent[t];
+    sim_replace_child(p->parent[t], p, b, t);
+    if (p->left[t] == b)
+    {
+        p->left[t] = b->right[t];
+        if (b->right[t] != NULL)
+            b->right[t]->parent[t] = p;
+        b->right[t] = p;
+    }
+    else
+    {
+        p->right[t] = b->left[t];
+        if (b->left[t] != NULL)
+            b->left[t]->parent[t] = p;
+        b->left[t] = p;
+    }
+    p->parent[t] = b;
+    sim_update(p, t);
+    sim_update(b, t);
+}
+
+// Restore the priority order after n was added as a leaf of tree t
+void sim_bubble_up(struct SimBlock *n, int t)
+{
+    while (n->parent[t] != NULL && n->parent[t]->priority < n->priority)
+        sim_rotate_up(n, t);
+    if (t == SIM_BY_ADDRESS)
+        sim_update_path(n);
+}
+
+void sim_unlink(struct SimBlock *b, int t)
+{
+    // Rotate b down until it has at most one child, then splice it out
+    while (b->left[t] != NULL && b->right[t] != NULL)
+        sim_rotate_up(b->left[t]->priority > b->right[t]->priority ? b->left[t] : b->right[t], t);
+    struct SimBlock *child = b->left[t] != NULL ? b->left[t] : b->right[t];
+    struct SimBlock *parent = b->parent[t];
+    sim_replace_child(parent, b, child, t);
+    b->left[t] = b->right[t] = b->parent[t] = NULL;
+    if (t == SIM_BY_ADDRESS)
+        sim_update_path(parent);
+}
+
+// Link n into the address tree right after b (as the first block if b is NULL)
+void sim_insert_after(struct SimBlock *b, struct SimBlock *n)
+{
+    const int t = SIM_BY_ADDRESS;
+    struct SimBlock *at = b == NULL ? sim_root[t] : b->right[t];
+    if (at == NULL)
+    {
+        if (b == NULL)
+            sim_root[t] = n;
+        else
+            b->right[t] = n;
+        n->parent[t] = b;
+    }
+    else
+    {
+        while (at->left[t] != NULL)
+            at = at->left[t];
+        at->left[t] = n;
+        n->parent[t] = at;
+    }
+    sim_update_path(n);
+    sim_bubble_up(n, t);
+}
+
+// Size order of the free tree: by size, then by address
+int sim_size_less(struct SimBlock *a, struct SimBlock *b)
+{
+    return a->size < b->size || (a->size == b->size && a->offset < b->offset);
+}
+
+void sim_size_insert(struct SimBlock *n)
+{
+    const int t = SIM_BY_SIZE;
+    struct SimBlock *parent = NULL;
+    struct SimBlock **link = &sim_root[t];
+    while (*link != NULL)
+    {
+        parent = *link;
+        link = sim_size_less(n, parent) ? &parent->left[t] : &parent->right[t];
+    }
+    *link = n;
+    n->parent[t] = parent;
+    sim_bubble_up(n, t);
+}
+
+// Mark b free or occupied, keeping the free tree in step
+void sim_set_free(struct SimBlock *b, int is_free)
+{
+    if (b->is_free && !is_free)
+        sim_unlink(b, SIM_BY_SIZE);
+    else if (!b->is_free && is_free)
+        sim_size_insert(b);
+    b->is_free = is_free;
+    sim_update_path(b);
+}
+
+// Change the size of b, keeping both trees in step
+void sim_resize(struct SimBlock *b, size_t size)
+{
+    if (b->is_free)
+        sim_unlink(b, SIM_BY_SIZE);
+    b->size = size;
+    if (b->is_free)
+        sim_size_insert(b);
+    sim_update_path(b);
+}
+
+struct SimBlock *sim_first()
+{
+    struct SimBlock *b = sim_root[SIM_BY_ADDRESS];
+    while (b != NULL && b->left[SIM_BY_ADDRESS] != NULL)
+        b = b->left[SIM_BY_ADDRESS];
+    return b;
+}
+
+// The block after b in address order, or NULL
+struct SimBlock *sim_next(struct SimBlock *b)
+{
+    const int t = SIM_BY_ADDRESS;
+    if (b->right[t] != NULL)
+    {
+        b = b->right[t];
+        while (b->left[t] != NULL)
+            b = b->left[t];
+        return b;
+    }
+    while (b->parent[t] != NULL && b->parent[t]->right[t] == b)
+        b = b->parent[t];
+    return b->parent[t];
+}
+
+// The lowest-addressed free block of at least size bytes, as mm_find_fit with MM_FIT_FIRST
+struct SimBlock *sim_first_fit(size_t size)
+{
+    const int t = SIM_BY_ADDRESS;
+    struct SimBlock *b = sim_root[t];
+    if (b == NULL || b->max_room <= size)
+        return NULL;
+    for (;;)
+    {
+        if (b->left[t] != NULL && b->left[t]->max_room > size)
+            b = b->left[t];
+        else if (b->is_free && b->size >= size)
+            return b;
+        else
+            b = b->right[t];
+    }
+}
+
+// The smallest free block of at least size bytes, the lowest-addressed one among
+// equals, which is what mm_find_fit with MM_FIT_BEST settles on
+struct SimBlock *sim_best_fit(size_t size)
+{
+    const int t = SIM_BY_SIZE;
+    struct SimBlock *fit = NULL;
+    for (struct SimBlock *b = sim_root[t]; b != NULL;)
+    {
+        if (b->size >= size)
+        {
+            fit = b;
+            b = b->left[t];
+        }
+        else
+        {
+            b = b->right[t];
+        }
+    }
+    return fit;
+}
+
+// Same rule as enoughToSplit and mm_split_block
+void sim_split(struct SimBlock *b, size_t size)
+{
+    if (b->size > size + meta_data_size)
+    {
+        struct SimBlock *rest = sim_new_block(b->offset + meta_data_size + size, b->size - size - meta_data_size);
+        sim_resize(b, size);
+        sim_insert_after(b, rest);
+        sim_set_free(rest, 1);
+        if (sim_tail == b)
+            sim_tail = rest;
+    }
+}
+
+// Returns a handle for sim_free, or NULL where mm_malloc would return NULL
+struct SimBlock *sim_malloc(size_t size)
+{
+    if (mm_mmap_threshold != 0 && size >= mm_mmap_threshold)
+    {
+        struct SimBlock *b = sim_new_block(0, size);
+        b->is_mapped = 1;
+        return b;
+    }
+
+    struct SimBlock *fit = mm_fit_policy == MM_FIT_FIRST ? sim_first_fit(size) : sim_best_fit(size);
+    if (fit != NULL)
+    {
+        sim_split(fit, size);
+        sim_set_free(fit, 0);
+        return fit;
+    }
+
+    if (sim_tail == NULL || !sim_tail->is_free)
+    {
+        if (size > sim_heap_size - sim_heap_used || sim_heap_size - sim_heap_used - size < meta_data_size)
+            return NULL;
+        struct SimBlock *b = sim_new_block(sim_heap_used, size);
+        sim_heap_used += size + meta_data_size;
+        sim_break_moves++;
+        sim_insert_after(sim_tail, b);
+        sim_tail = b;
+        return b;
+    }
+
+    if (size - sim_tail->size > sim_heap_size - sim_heap_used)
+        return NULL;
+    sim_heap_used += size - sim_tail->size;
+    sim_break_moves++;
+    sim_set_free(sim_tail, 0);
+    sim_resize(sim_tail, size);
+    return sim_tail;
+}
+
+void sim_free(struct SimBlock *b)
+{
+    if (b->is_mapped)
+        sim_release_block(b);
+    else
+        sim_set_free(b, 1);
+}
+
+void sim_combine_nearby_free()
+{
+    for (struct SimBlock *b = sim_first(); b != NULL; b = sim_next(b))
+    {
+        struct SimBlock *next;
+        while (b->is_free && (next = sim_next(b)) != NULL && next->is_free)
+        {
+            if (sim_tail == next)
+                sim_tail = b;
+            sim_set_free(next, 0);
+            sim_unlink(next, SIM_BY_ADDRESS);
+            sim_resize(b, b->size + meta_data_size + next->size);
+            sim_release_block(next);
+        }
+    }
+}
+
+void sim_print()
+{
+    int i = 1;
+    for (struct SimBlock *b = sim_first(); b != NULL; b = sim_next(b))
+        mm_print_block(i++, b->is_free, b->size);
+}
+
+void sim_get_stats(struct MMStats *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->heap_size = sim_heap_size;
+    for (struct SimBlock *b = sim_first(); b != NULL; b = sim_next(b))
+    {
+        if (b->is_free)
+        {
+            st->free_blocks++;
+            st->free_bytes += b->size;
+            if (b->size > st->largest_free_block)
+                st->largest_free_block = b->size;
+        }
+        else
+        {
+            st->occupied_blocks++;
+            st->occupied_bytes += b->size;
+        }
+    }
+    size_t unused = sim_heap_size - sim_heap_used;
+    st->free_bytes += unused;
+    if (unused > st->largest_free_block)
+        st->largest_free_block = unused;
+    st->fragmentation = st->free_bytes == 0 ? 0.0 : 1.0 - (double)st->largest_free_block / st->free_bytes;
+    st->break_moves = sim_break_moves;
+}
+// ==== End metadata-only simulator =======
+
+// ==== Multi-threaded replay =======
+//
+// Trace lines may start with a thread ID, e.g. "@2 malloc a 10". With --threads
+// the driver replays every thread's operations on a real thread of its own, so
+// the allocator sees real contention. Operations on the same block name still
+// happen in trace order: each name has a counter of completed operations, and an
+// operation waits until the counter reaches its position among that name's
+// operations. A free on another thread thus waits for the matching malloc.
+// Heap layouts are not printed per operation, since threads interleave freely.
+
+#define MAX_REPLAY_THREADS 64
+
+struct Replay
+{
+    int sz_operations;
+    char *operation_types;
+    char *pointer_chars;
+    int *malloc_sizes;
+    int *thread_ids;
+    int *name_sequence;     // position of each operation among those on its block name
+    void **pointers;        // a=>0, b=>1, ..., z=>25, as in main
+    atomic_int *name_done;  // completed operations per block name
+};
+
+struct ReplayThread
+{
+    struct Replay *replay;
+    int thread_id;
+    pthread_t thread;
+};
+
+void *mm_replay_thread(void *arg)
+{
+    struct ReplayThread *t = arg;
+    struct Replay *r = t->replay;
+    for (int i = 0; i < r->sz_operations; i++)
+    {
+        if (r->thread_ids[i] != t->thread_id)
+            continue;
+        if (r->operation_types[i] == OPERATION_TYPE_COMBINE_NEARBY_FREE)
+        {
+            mm_combine_nearby_free();
+            continue;
+        }
+
+        char block_name = r->pointer_chars[i];
+        int name = block_name - 'a';
+        while (atomic_load_explicit(&r->name_done[name], memory_order_acquire) != r->name_sequence[i])
+            sched_yield();
+
+        if (r->operation_types[i] == OPERATION_TYPE_MALLOC)
+        {
+            if (r->pointers[name] != NULL)
+                printf("malloc Error: %c is pointing to some memory address\n", block_name);
+            else
+            {
+                char *target = mm_malloc(r->malloc_sizes[i]);
+                if (target != NULL)
+                    mm_fill(target, ' ', r->malloc_sizes[i]);
+                r->pointers[name] = target;
+            }
+        }
+        else if (r->operation_types[i] == OPERATION_TYPE_FREE)
+        {
+            if (r->pointers[name] == NULL)
+                printf("free Error: %c is pointing to NULL\n", block_name);
+            else
+            {
+                mm_free(r->pointers[name]);
+                r->pointers[name] = NULL;
+            }
+        }
+        atomic_store_explicit(&r->name_done[name], r->name_sequence[i] + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+// Returns the number of threads used, or -1 if the trace has too many threads
+int mm_replay_threaded(struct Replay *r)
+{
+    struct ReplayThread threads[MAX_REPLAY_THREADS];
+    int thread_count = 0;
+    int name_count[MAX_POINTERS];
+    for (int i = 0; i < MAX_POINTERS; i++)
+    {
+        name_count[i] = 0;
+        atomic_init(&r->name_done[i], 0);
+    }
+
+    for (int i = 0; i < r->sz_operations; i++)
+    {
+        if (r->operation_types[i] != OPERATION_TYPE_COMBINE_NEARBY_FREE)
+            r->name_sequence[i] = name_count[r->pointer_chars[i] - 'a']++;
+
+        int known = 0;
+        for (int j = 0; j < thread_count; j++)
+            known |= threads[j].thread_id == r->thread_ids[i];
+        if (!known)
+        {
+            if (thread_count == MAX_REPLAY_THREADS)
+                return -1;
+            threads[thread_count].replay = r;
+            threads[thread_count].thread_id = r->thread_ids[i];
+            thread_count++;
+        }
+    }
+
+    for (int j = 0; j < thread_count; j++)
+        pthread_create(&threads[j].thread, NULL, mm_replay_thread, &threads[j]);
+    for (int j = 0; j < thread_count; j++)
+        pthread_join(threads[j].thread, NULL);
+    return thread_count;
+}
+// ==== End multi-threaded replay =======
+
+// Programs that link the allocator in (e.g. smm_bench.c) define SMM_NO_MAIN
+#ifndef SMM_NO_MAIN
+// Usage: simplified_smm [--simulate] [--checkpoint N FILE] [--resume FILE] [--threads] [--best-fit] < trace
+//   --simulate           replay the trace on the metadata-only simulator instead of the heap
+//   --checkpoint N FILE  save the allocator state to FILE after operation N
+//   --resume FILE        continue the trace from the checkpoint in FILE,
+//                        skipping the operations before it without replaying them
+//   --threads            replay each thread ID of the trace ("@2 malloc a 10") on its own thread
+//   --best-fit           take the smallest free block that fits instead of the first
+int main(int argc, char **argv)
+{
+    char operation_types[MAX_OPERATIONS];
+    char pointer_chars[MAX_OPERATIONS];
+    int malloc_sizes[MAX_OPERATIONS];
+    int thread_ids[MAX_OPERATIONS];
+    int sz_operations;
+    int i;
+
+    // Assume there are at most 26 different malloc/free
+    // Here is the rule to map the block_name to pointers index
+    // a=>0, b=>1, ..., z=>25
+    void *pointers[MAX_POINTERS];
+    for (i = 0; i < MAX_POINTERS; i++)
+        pointers[i] = NULL;
+    char *target = NULL;
+
+    char command[30];  // malloc/free/combine_nearby_free
+    char block_name;   // a-z
+    size_t block_size; // a non-negative integer
+    int simulate = 0;
+    long checkpoint_at = -1;
+    const char *checkpoint_file = NULL;
+    const char *resume_file = NULL;
+    long first_operation = 0;
+    int threaded = 0;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--simulate") == 0)
+            simulate = 1;
+        else if (strcmp(argv[i], "--checkpoint") == 0 && i + 2 < argc)
+        {
+            checkpoint_at = atol(argv[++i]);
+            checkpoint_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "--resume") == 0 && i + 1 < argc)
+            resume_file = argv[++i];
+        else if (strcmp(argv[i], "--threads") == 0)
+            threaded = 1;
+        else if (strcmp(argv[i], "--best-fit") == 0)
+            mm_fit_policy = MM_FIT_BEST;
+    }
+    if (simulate && (checkpoint_file != NULL || resume_file != NULL))
+    {
+        printf("Error: checkpoints need the real heap, not --simulate\n");
+        exit(-1);
+    }
+
+    scanf("%d", &sz_operations); // read the number of operations
+    for (i = 0; i < sz_operations; i++)
+    {
+        scanf("%s", command);
+        thread_ids[i] = 0;
+        if (command[0] == '@')
+        {
+            thread_ids[i] = atoi(command + 1);
+            scanf("%s", command);
+        }
+        if (strcmp(command, OPERATION_STR_MALLOC) == 0)
+        {
+            scanf(" %c %ld", &block_name, &block_size);
+            operation_types[i] = OPERATION_TYPE_MALLOC;
+            pointer_chars[i] = block_name;
+            malloc_sizes[i] = block_size;
+        }
+        else if (strcmp(command, OPERATION_STR_FREE) == 0)
+        {
+            scanf(" %c", &block_name);
+            operation_types[i] = OPERATION_TYPE_FREE;
+            pointer_chars[i] = block_name;
+        }
+        else if (strcmp(command, OPERATION_STR_COMBINE_NEARBY_FREE) == 0)
+        {
+            operation_types[i] = OPERATION_TYPE_COMBINE_NEARBY_FREE;
+        }
+    }
+
+    if (simulate)
+    {
+        sim_init(HEAP_SIZE);
+    }
+    else
+    {
+        heap_start = mmap(NULL, HEAP_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+        if (heap_start == MAP_FAILED)
+        {
+            printf("Error in creating heap using mmap\n");
+            exit(-1);
+        }
+        heap_current_break = heap_start;
+        heap_end = heap_start + HEAP_SIZE;
+    }
+
+    if (resume_file != NULL)
+    {
+        FILE *f = fopen(resume_file, "rb");
+        if (f == NULL || mm_checkpoint_load(f, &first_operation, pointers, MAX_POINTERS) != 0)
+        {
+            printf("Error in loading checkpoint %s\n", resume_file);
+            exit(-1);
+        }
+        fclose(f);
+    }
+
+    if (threaded && !simulate)
+    {
+        int name_sequence[MAX_OPERATIONS];
+        atomic_int name_done[MAX_POINTERS];
+        struct Replay replay = {sz_operations - first_operation, operation_types + first_operation,
+                                pointer_chars + first_operation, malloc_sizes + first_operation,
+                                thread_ids + first_operation, name_sequence, pointers, name_done};
+        int thread_count = mm_replay_threaded(&replay);
+        if (thread_count < 0)
+        {
+            printf("Error: more than %d threads in the trace\n", MAX_REPLAY_THREADS);
+            exit(-1);
+        }
+        printf("=== Replayed %d operations on %d threads ===\n", replay.sz_operations, thread_count);
+        mm_print();
+        first_operation = sz_operations; // nothing left for the sequential replay
+    }
+
+    for (i = first_operation; i < sz_operations; i++)
+    {
+        if (operation_types[i] == OPERATION_TYPE_MALLOC)
+        {
+            block_name = pointer_chars[i];
+            block_size = malloc_sizes[i];
+            if (pointers[block_name - 'a'] != NULL)
+            {
+                printf("=== %s %c %ld ===\n", OPERATION_STR_MALLOC, block_name, block_size);
+                printf("malloc Error: %c is pointing to some memory address\n", block_name);
+            }
+            else
+            {
+                target = simulate ? (char *)sim_malloc(block_size) : mm_malloc(block_size);
+                if (target != NULL && !simulate)
+                {
+                    // This operation ensures that the returned pointer is correct
+                    // As we only fill characters up to the block size,
+                    // no meta data should be erased
+                    mm_fill(target, ' ', block_size); // 2024-Nov-19: Fixed this line 
+                }
+                pointers[block_name - 'a'] = target;
+                printf("=== %s %c %ld ===\n", OPERATION_STR_MALLOC, block_name, block_size);
+                simulate ? sim_print() : mm_print();
+            }
+        }
+        else if (operation_types[i] == OPERATION_TYPE_FREE)
+        {
+            block_name = pointer_chars[i];
+            if (pointers[block_name - 'a'] == NULL)
+            {
+                printf("=== %s %c ===\n", OPERATION_STR_FREE, block_name);
+                printf("free Error: %c is pointing to NULL\n", block_name);
+            }
+            else
+            {
+                if (simulate)
+                    sim_free(pointers[block_name - 'a']);
+                else
+                    mm_free(pointers[block_name - 'a']);
+                pointers[block_name - 'a'] = NULL;
+                printf("=== %s %c ===\n", OPERATION_STR_FREE, block_name);
+                simulate ? sim_print() : mm_print();
+            }
+        }
+        else if (operation_types[i] == OPERATION_TYPE_COMBINE_NEARBY_FREE)
+        {
+            simulate ? sim_combine_nearby_free() : mm_combine_nearby_free();
+            printf("=== Combine nearby free blocks ===\n");
+            simulate ? sim_print() : mm_print();
+        }
+
+        if (i + 1 == checkpoint_at)
+        {
+            FILE *f = fopen(checkpoint_file, "wb");
+            if (f == NULL || mm_checkpoint_save(f, i + 1, pointers, MAX_POINTERS) != 0)
+            {
+                printf("Error in saving checkpoint %s\n", checkpoint_file);
+                exit(-1);
+            }
+            fclose(f);
+        }
+    }
+
+    if (!simulate && munmap(heap_start, HEAP_SIZE))
+    {
+        // failure case
+        printf("Error in munmap\n");
+        exit(-1);
+    }
+
+    return 0;
+}
+#endif // SMM_NO_MAIN
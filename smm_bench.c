@@ -0,0 +1,930 @@
+// Benchmarks for the allocator in simplified_smm.c
+//
+// Build: gcc -O2 -pthread smm_bench.c -o smm_bench
+// Usage: ./smm_bench [benchmark ...]   (no argument runs all of them)
+
+#define SMM_NO_MAIN
+#include "simplified_smm.c"
+
+#include <time.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+const size_t BENCH_HEAP_SIZE = 64 * 1024 * 1024;
+
+double bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Cycle counter where there is one, nanoseconds elsewhere
+unsigned long long bench_cycles()
+{
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    return (unsigned long long)(bench_now() * 1e9);
+#endif
+}
+
+// Give the allocator a fresh heap of the given size, like main() in simplified_smm.c
+void bench_heap_init(size_t size)
+{
+    if (heap_start != NULL)
+        munmap(heap_start, heap_end - heap_start);
+    heap_start = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (heap_start == MAP_FAILED)
+    {
+        printf("Error in creating heap using mmap\n");
+        exit(-1);
+    }
+    heap_current_break = heap_start;
+    heap_end = heap_start + size;
+    heap_short_lived_break = NULL;
+}
+
+// ==== realloc: geometric buffer growth =======
+//
+// Grow a buffer from 4 KB to 512 MB, doubling each time and writing the new tail,
+// once through mm_realloc (mremap of a dedicated mapping) and once through the
+// copy path (mm_malloc + memcpy + mm_free).
+
+const size_t REALLOC_FIRST_SIZE = 4 * 1024;
+const size_t REALLOC_LAST_SIZE = 512 * 1024 * 1024;
+
+double bench_realloc_grow(int use_mremap)
+{
+    size_t size = REALLOC_FIRST_SIZE;
+    char *buf = mm_malloc(size);
+    memset(buf, 1, size);
+
+    double start = bench_now();
+    while (size < REALLOC_LAST_SIZE)
+    {
+        size_t new_size = size * 2;
+        char *new_buf;
+        if (use_mremap)
+        {
+            new_buf = mm_realloc(buf, new_size);
+        }
+        else
+        {
+            new_buf = mm_malloc(new_size);
+            memcpy(new_buf, buf, size);
+            mm_free(buf);
+        }
+        memset(new_buf + size, 1, new_size - size);
+        buf = new_buf;
+        size = new_size;
+    }
+    double elapsed = bench_now() - start;
+    mm_free(buf);
+    return elapsed;
+}
+
+void bench_realloc()
+{
+    size_t threshold = mm_mmap_threshold;
+    bench_heap_init(BENCH_HEAP_SIZE);
+    mm_set_mmap_threshold(REALLOC_FIRST_SIZE);
+    printf("realloc: geometric growth %zu KB -> %zu MB\n", REALLOC_FIRST_SIZE / 1024, REALLOC_LAST_SIZE >> 20);
+    printf("  copy path   : %8.2f ms\n", bench_realloc_grow(0) * 1e3);
+    printf("  mremap path : %8.2f ms\n", bench_realloc_grow(1) * 1e3);
+    mm_set_mmap_threshold(threshold);
+}
+// ==== End realloc =======
+
+// ==== kernels: copy/fill throughput =======
+//
+// Bytes per cycle of mm_copy/mm_fill against memcpy/memset, for sizes from one
+// cache line to well past the non-temporal threshold.
+
+void bench_libc_copy(void *dst, const void *src, size_t n)
+{
+    memcpy(dst, src, n);
+}
+
+void bench_libc_fill(void *dst, int c, size_t n)
+{
+    memset(dst, c, n);
+}
+
+double bench_copy_rate(void (*copy)(void *, const void *, size_t), char *dst, char *src, size_t n, size_t total)
+{
+    unsigned long long start = bench_cycles();
+    for (size_t done = 0; done < total; done += n)
+        copy(dst, src, n);
+    return (double)total / (bench_cycles() - start);
+}
+
+double bench_fill_rate(void (*fill)(void *, int, size_t), char *dst, size_t n, size_t total)
+{
+    unsigned long long start = bench_cycles();
+    for (size_t done = 0; done < total; done += n)
+        fill(dst, ' ', n);
+    return (double)total / (bench_cycles() - start);
+}
+
+void bench_kernels()
+{
+    const size_t max_size = 64 * 1024 * 1024;
+    const size_t total = 1024UL * 1024 * 1024;
+    char *src = mmap(NULL, max_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    char *dst = mmap(NULL, max_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    memset(src, 1, max_size);
+    memset(dst, 2, max_size);
+
+    // The first call picks the kernels for this CPU
+    mm_copy(dst, src, 1);
+    mm_fill(dst, 0, 1);
+
+    printf("kernels: bytes/cycle (1 byte offset into the buffers)\n");
+    printf("  %10s %10s %10s %10s %10s\n", "size", "mm_copy", "memcpy", "mm_fill", "memset");
+    for (size_t n = 64; n <= max_size; n *= 8)
+    {
+        printf("  %10zu %10.2f %10.2f %10.2f %10.2f\n", n,
+               bench_copy_rate(mm_copy, dst + 1, src, n, total),
+               bench_copy_rate(bench_libc_copy, dst + 1, src, n, total),
+               bench_fill_rate(mm_fill, dst + 1, n, total),
+               bench_fill_rate(bench_libc_fill, dst + 1, n, total));
+    }
+    munmap(src, max_size);
+    munmap(dst, max_size);
+}
+// ==== End kernels =======
+
+// ==== prefault: allocation plus first touch latency =======
+//
+// Latency percentiles of mm_malloc followed by writing the whole payload, on a
+// fresh heap, with each prefault mode of mm_set_prefault_mode. Blocks are large
+// and few so that page faults, not the first-fit scan, dominate.
+
+const int PREFAULT_OPS = 512;
+const int PREFAULT_RUNS = 16;
+const size_t PREFAULT_BLOCK = 32 * 1024;
+const size_t PREFAULT_AHEAD = 4 * 1024 * 1024;
+
+int bench_compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+void bench_prefault_mode(const char *name, int flags, double *latency)
+{
+    size_t threshold = mm_mmap_threshold;
+    // Several short runs on fresh heaps, so the percentiles have enough samples
+    for (int run = 0; run < PREFAULT_RUNS; run++)
+    {
+        bench_heap_init(PREFAULT_OPS * (PREFAULT_BLOCK + meta_data_size) + PREFAULT_AHEAD);
+        mm_set_mmap_threshold(0);
+        mm_set_prefault_mode(flags, PREFAULT_AHEAD);
+        for (int i = 0; i < PREFAULT_OPS; i++)
+        {
+            double start = bench_now();
+            char *p = mm_malloc(PREFAULT_BLOCK);
+            memset(p, 1, PREFAULT_BLOCK);
+            latency[run * PREFAULT_OPS + i] = bench_now() - start;
+            if (flags & MM_PREFAULT_ASYNC)
+            {
+                // Leave the background thread some room, as a service between requests would
+                for (volatile int spin = 0; spin < 20000; spin++)
+                    ;
+            }
+        }
+        mm_set_prefault_mode(0, 0);
+    }
+    mm_set_mmap_threshold(threshold);
+
+    int samples = PREFAULT_RUNS * PREFAULT_OPS;
+    qsort(latency, samples, sizeof(double), bench_compare_double);
+    printf("  %-12s %8.0f %8.0f %8.0f %8.0f\n", name,
+           latency[samples / 2] * 1e9,
+           latency[samples * 99 / 100] * 1e9,
+           latency[samples * 999 / 1000] * 1e9,
+           latency[samples - 1] * 1e9);
+}
+
+void bench_prefault()
+{
+    double *latency = malloc(PREFAULT_RUNS * PREFAULT_OPS * sizeof(double));
+    printf("prefault: mm_malloc(%zu) + first touch, ns\n", PREFAULT_BLOCK);
+    printf("  %-12s %8s %8s %8s %8s\n", "mode", "p50", "p99", "p99.9", "max");
+    bench_prefault_mode("off", 0, latency);
+    bench_prefault_mode("touch", MM_PREFAULT_TOUCH, latency);
+    bench_prefault_mode("touch+async", MM_PREFAULT_TOUCH | MM_PREFAULT_ASYNC, latency);
+    bench_prefault_mode("mlock", MM_PREFAULT_MLOCK, latency);
+    free(latency);
+}
+// ==== End prefault =======
+
+// ==== stress: classic multi-threaded allocator workloads =======
+//
+// Small versions of the workloads allocators are usually compared on: larson
+// (server threads that inherit each other's blocks), xmalloc (producers
+// allocate, consumers free), cache-scratch and cache-thrash (false sharing
+// between small blocks of different threads) and a glibc-bench style random
+// size test. Working sets are kept small since every mm_malloc scans the heap.
+
+const int STRESS_THREADS = 4;
+const int STRESS_SLOTS = 256;
+const int STRESS_OPS = 20000;
+const size_t STRESS_HEAP_SIZE = 16 * 1024 * 1024;
+
+unsigned bench_rand(unsigned *state)
+{
+    // xorshift32, so threads do not share the state of rand()
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+struct StressThread
+{
+    pthread_t thread;
+    unsigned seed;
+    char **slots;
+    void *(*run)(void *);
+};
+
+// Runs one thread per entry and returns the wall clock time taken
+double bench_run_threads(struct StressThread *threads, int count)
+{
+    double start = bench_now();
+    for (int i = 0; i < count; i++)
+        pthread_create(&threads[i].thread, NULL, threads[i].run, &threads[i]);
+    for (int i = 0; i < count; i++)
+        pthread_join(threads[i].thread, NULL);
+    return bench_now() - start;
+}
+
+void *bench_larson_thread(void *arg)
+{
+    struct StressThread *t = arg;
+    for (int i = 0; i < STRESS_OPS; i++)
+    {
+        int slot = bench_rand(&t->seed) % STRESS_SLOTS;
+        if (t->slots[slot] != NULL)
+            mm_free(t->slots[slot]);
+        t->slots[slot] = mm_malloc(16 + bench_rand(&t->seed) % 240);
+        if (t->slots[slot] != NULL)
+            t->slots[slot][0] = 1;
+    }
+    return NULL;
+}
+
+void bench_larson()
+{
+    const int rounds = 5;
+    struct StressThread threads[STRESS_THREADS];
+    bench_heap_init(STRESS_HEAP_SIZE);
+    for (int i = 0; i < STRESS_THREADS; i++)
+    {
+        threads[i].seed = i + 1;
+        threads[i].run = bench_larson_thread;
+        threads[i].slots = malloc(STRESS_SLOTS * sizeof(char *));
+        for (int j = 0; j < STRESS_SLOTS; j++)
+            threads[i].slots[j] = mm_malloc(16 + bench_rand(&threads[i].seed) % 240);
+    }
+
+    // Each round starts new threads, which free the blocks the previous round left
+    double elapsed = 0;
+    for (int round = 0; round < rounds; round++)
+        elapsed += bench_run_threads(threads, STRESS_THREADS);
+
+    printf("  %-14s %10.0f ops/s\n", "larson", rounds * STRESS_THREADS * STRESS_OPS / elapsed);
+    for (int i = 0; i < STRESS_THREADS; i++)
+    {
+        for (int j = 0; j < STRESS_SLOTS; j++)
+            if (threads[i].slots[j] != NULL)
+                mm_free(threads[i].slots[j]);
+        free(threads[i].slots);
+    }
+}
+
+// Producers push blocks into a bounded queue, consumers pop and free them
+struct StressQueue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    char *items[64];
+    int head, count, producers_left;
+};
+
+struct StressQueue xmalloc_queue = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+void *bench_xmalloc_producer(void *arg)
+{
+    struct StressThread *t = arg;
+    struct StressQueue *q = &xmalloc_queue;
+    for (int i = 0; i < STRESS_OPS; i++)
+    {
+        char *p = mm_malloc(16 + bench_rand(&t->seed) % 240);
+        pthread_mutex_lock(&q->lock);
+        while (q->count == 64)
+            pthread_cond_wait(&q->changed, &q->lock);
+        q->items[(q->head + q->count++) % 64] = p;
+        pthread_cond_broadcast(&q->changed);
+        pthread_mutex_unlock(&q->lock);
+    }
+    pthread_mutex_lock(&q->lock);
+    q->producers_left--;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+void *bench_xmalloc_consumer(void *arg)
+{
+    struct StressQueue *q = &xmalloc_queue;
+    for (;;)
+    {
+        pthread_mutex_lock(&q->lock);
+        while (q->count == 0 && q->producers_left > 0)
+            pthread_cond_wait(&q->changed, &q->lock);
+        if (q->count == 0)
+        {
+            pthread_mutex_unlock(&q->lock);
+            return NULL;
+        }
+        char *p = q->items[q->head];
+        q->head = (q->head + 1) % 64;
+        q->count--;
+        pthread_cond_broadcast(&q->changed);
+        pthread_mutex_unlock(&q->lock);
+        if (p != NULL)
+            mm_free(p);
+    }
+}
+
+void bench_xmalloc()
+{
+    struct StressThread threads[STRESS_THREADS];
+    bench_heap_init(STRESS_HEAP_SIZE);
+    xmalloc_queue.head = xmalloc_queue.count = 0;
+    xmalloc_queue.producers_left = STRESS_THREADS / 2;
+    for (int i = 0; i < STRESS_THREADS; i++)
+    {
+        threads[i].seed = i + 1;
+        threads[i].run = i < STRESS_THREADS / 2 ? bench_xmalloc_producer : bench_xmalloc_consumer;
+    }
+    double elapsed = bench_run_threads(threads, STRESS_THREADS);
+    printf("  %-14s %10.0f ops/s\n", "xmalloc", STRESS_THREADS / 2 * STRESS_OPS / elapsed);
+}
+
+// cache-scratch hands each thread a small block allocated next to the others;
+// cache-thrash lets the threads allocate their own. Either way each thread then
+// keeps allocating, writing and freeing a small block.
+const int CACHE_WRITES = 1000;
+
+void *bench_cache_thread(void *arg)
+{
+    struct StressThread *t = arg;
+    if (t->slots[0] != NULL)
+        mm_free(t->slots[0]);
+    for (int i = 0; i < STRESS_OPS / 10; i++)
+    {
+        volatile char *p = mm_malloc(8);
+        for (int j = 0; j < CACHE_WRITES; j++)
+            p[j % 8]++;
+        mm_free((void *)p);
+    }
+    return NULL;
+}
+
+void bench_cache(const char *name, int passive)
+{
+    struct StressThread threads[STRESS_THREADS];
+    char *handed_out[STRESS_THREADS];
+    bench_heap_init(STRESS_HEAP_SIZE);
+    for (int i = 0; i < STRESS_THREADS; i++)
+    {
+        handed_out[i] = passive ? mm_malloc(8) : NULL;
+        threads[i].slots = &handed_out[i];
+        threads[i].run = bench_cache_thread;
+    }
+    double elapsed = bench_run_threads(threads, STRESS_THREADS);
+    printf("  %-14s %10.2f ms\n", name, elapsed * 1e3);
+}
+
+// Single thread, random sizes skewed towards small blocks, random slot replaced
+void bench_random_sizes()
+{
+    unsigned seed = 42;
+    char *slots[STRESS_SLOTS];
+    bench_heap_init(STRESS_HEAP_SIZE);
+    memset(slots, 0, sizeof(slots));
+
+    double start = bench_now();
+    for (int i = 0; i < STRESS_OPS * 4; i++)
+    {
+        int slot = bench_rand(&seed) % STRESS_SLOTS;
+        unsigned r = bench_rand(&seed);
+        size_t size = (r % 100 < 90) ? 8 + r % 128 : (r % 100 < 99) ? 512 + r % 4096 : 16384 + r % 32768;
+        if (slots[slot] != NULL)
+            mm_free(slots[slot]);
+        slots[slot] = mm_malloc(size);
+    }
+    double elapsed = bench_now() - start;
+    printf("  %-14s %10.1f ns/op\n", "random-sizes", elapsed * 1e9 / (STRESS_OPS * 4));
+    for (int i = 0; i < STRESS_SLOTS; i++)
+        if (slots[i] != NULL)
+            mm_free(slots[i]);
+}
+
+void bench_stress()
+{
+    printf("stress: %d threads, %d slots\n", STRESS_THREADS, STRESS_SLOTS);
+    bench_larson();
+    bench_xmalloc();
+    bench_cache("cache-scratch", 1);
+    bench_cache("cache-thrash", 0);
+    bench_random_sizes();
+}
+// ==== End stress =======
+
+// ==== fragment: adversarial layouts, per fit policy =======
+//
+// Workloads that leave first fit with holes it cannot use: alternating small and
+// large blocks with the large ones freed, a sawtooth of sizes with every other
+// block freed, and a block that keeps growing. Each runs once per fit policy and
+// reports the peak heap size over the peak live bytes, the longest mm_malloc
+// search and the slowest mm_malloc call.
+
+const size_t FRAGMENT_HEAP_SIZE = 64 * 1024 * 1024;
+
+struct FragmentRun
+{
+    size_t live, peak_live, peak_heap;
+    double worst;
+};
+
+struct FragmentRun fragment_run;
+
+char *bench_fragment_malloc(size_t size)
+{
+    double start = bench_now();
+    char *p = mm_malloc(size);
+    double elapsed = bench_now() - start;
+    if (elapsed > fragment_run.worst)
+        fragment_run.worst = elapsed;
+    if (p == NULL)
+        return NULL;
+
+    fragment_run.live += size;
+    if (fragment_run.live > fragment_run.peak_live)
+        fragment_run.peak_live = fragment_run.live;
+    size_t heap = heap_current_break - heap_start;
+    if (heap > fragment_run.peak_heap)
+        fragment_run.peak_heap = heap;
+    return p;
+}
+
+void bench_fragment_free(char *p, size_t size)
+{
+    if (p == NULL)
+        return;
+    mm_free(p);
+    fragment_run.live -= size;
+}
+
+// Small/large pairs; free the large ones, then ask for slightly more than they held
+void bench_fragment_alternating()
+{
+    const int pairs = 1000;
+    char *small[pairs], *large[pairs];
+    for (int round = 0; round < 4; round++)
+    {
+        size_t large_size = 1024 + round * 128;
+        for (int i = 0; i < pairs; i++)
+        {
+            small[i] = bench_fragment_malloc(16);
+            large[i] = bench_fragment_malloc(large_size);
+        }
+        for (int i = 0; i < pairs; i++)
+            bench_fragment_free(large[i], large_size);
+        if (round < 3)
+            continue;
+        for (int i = 0; i < pairs; i++)
+            bench_fragment_free(small[i], 16);
+    }
+}
+
+// Sizes ramp up and drop back, each ramp a little steeper; after each ramp
+// every other block of it is freed
+void bench_fragment_sawtooth()
+{
+    const int teeth = 20, steps = 100;
+    char *blocks[teeth][steps];
+    size_t sizes[teeth][steps];
+    for (int tooth = 0; tooth < teeth; tooth++)
+    {
+        for (int step = 0; step < steps; step++)
+        {
+            sizes[tooth][step] = 16 + step * (16 + tooth);
+            blocks[tooth][step] = bench_fragment_malloc(sizes[tooth][step]);
+        }
+        for (int step = 1; step < steps; step += 2)
+            bench_fragment_free(blocks[tooth][step], sizes[tooth][step]);
+    }
+    for (int tooth = 0; tooth < teeth; tooth++)
+    {
+        for (int step = 0; step < steps; step += 2)
+            bench_fragment_free(blocks[tooth][step], sizes[tooth][step]);
+    }
+}
+
+// A buffer that grows by reallocation, next to a small block that pins each hole
+void bench_fragment_growing()
+{
+    const int steps = 500;
+    char *buf = NULL;
+    size_t buf_size = 0;
+    char *pins[steps];
+    for (int i = 0; i < steps; i++)
+    {
+        size_t size = 64 + i * 48;
+        char *p = bench_fragment_malloc(size);
+        pins[i] = bench_fragment_malloc(8);
+        bench_fragment_free(buf, buf_size);
+        buf = p;
+        buf_size = size;
+    }
+    bench_fragment_free(buf, buf_size);
+    for (int i = 0; i < steps; i++)
+        bench_fragment_free(pins[i], 8);
+}
+
+void bench_fragment()
+{
+    struct
+    {
+        const char *name;
+        void (*run)();
+    } workloads[] = {
+        {"alternating", bench_fragment_alternating},
+        {"sawtooth", bench_fragment_sawtooth},
+        {"growing", bench_fragment_growing},
+    };
+    const char *policy_names[] = {"first", "best"};
+    int policies[] = {MM_FIT_FIRST, MM_FIT_BEST};
+    size_t threshold = mm_mmap_threshold;
+    int fit_policy = mm_fit_policy;
+
+    printf("fragment: peak heap / peak live, longest search (blocks), slowest mm_malloc\n");
+    printf("  %-12s %-6s %10s %10s %10s\n", "workload", "fit", "heap/live", "scan", "worst us");
+    for (int w = 0; w < 3; w++)
+    {
+        for (int f = 0; f < 2; f++)
+        {
+            bench_heap_init(FRAGMENT_HEAP_SIZE);
+            mm_set_mmap_threshold(0);
+            mm_set_fit_policy(policies[f]);
+            mm_max_scan_length = 0;
+            memset(&fragment_run, 0, sizeof(fragment_run));
+            workloads[w].run();
+
+            struct MMStats st;
+            mm_get_stats(&st);
+            printf("  %-12s %-6s %10.2f %10lu %10.1f\n", workloads[w].name, policy_names[f],
+                   (double)fragment_run.peak_heap / fragment_run.peak_live,
+                   st.max_scan_length, fragment_run.worst * 1e6);
+        }
+    }
+    mm_set_fit_policy(fit_policy);
+    mm_set_mmap_threshold(threshold);
+}
+// ==== End fragment =======
+
+// ==== policies: compile-time heap policies =======
+//
+// Random replacement of small blocks in heaps generated by MM_DEFINE_HEAP, next
+// to the same workload on a private heap (mm_heap_malloc, run-time fit policy
+// and a mutex). Without merging, a malloc walks about 1200 headers, each load
+// waiting for the size read before it, so the fit and lock policies are lost in
+// the walk; only merging on free changes the time.
+
+const int POLICY_SLOTS = 256;
+const int POLICY_OPS = 200000;
+const size_t POLICY_HEAP_SIZE = 16 * 1024 * 1024;
+
+MM_DEFINE_HEAP(bench_first_heap, mm_first_fit, mm_split_always, mm_coalesce_deferred, mm_lock_none, mm_header_meta)
+MM_DEFINE_HEAP(bench_best_heap, mm_best_fit, mm_split_always, mm_coalesce_deferred, mm_lock_none, mm_header_meta)
+MM_DEFINE_HEAP(bench_merging_heap, mm_first_fit, mm_split_always, mm_coalesce_immediate, mm_lock_mutex, mm_header_meta)
+MM_DEFINE_HEAP(bench_compact_merging_heap, mm_first_fit, mm_split_always, mm_coalesce_immediate, mm_lock_mutex,
+               mm_header_compact)
+
+// The generated heaps share this shape, so one driver runs them all
+#define BENCH_POLICY_RUN(label, heap)                                              \
+    do                                                                             \
+    {                                                                              \
+        __typeof__(heap##_create(0)) h = heap##_create(POLICY_HEAP_SIZE);          \
+        char *slots[POLICY_SLOTS];                                                 \
+        memset(slots, 0, sizeof(slots));                                           \
+        unsigned seed = 7;                                                         \
+        double start = bench_now();                                                \
+        for (int i = 0; i < POLICY_OPS; i++)                                       \
+        {                                                                          \
+            int slot = bench_rand(&seed) % POLICY_SLOTS;                           \
+            if (slots[slot] != NULL)                                               \
+                heap##_free(h, slots[slot]);                                       \
+            slots[slot] = heap##_malloc(h, 16 + bench_rand(&seed) % 240);          \
+        }                                                                          \
+        double elapsed = bench_now() - start;                                      \
+        printf("  %-24s %8.1f ns/op %10zu heap bytes\n", label,                   \
+               elapsed * 1e9 / POLICY_OPS, (size_t)(h->current_break - h->start)); \
+        heap##_destroy(h);                                                         \
+    } while (0)
+
+void bench_policies()
+{
+    printf("policies: %d random replacements of %d blocks of 16-255 bytes\n", POLICY_OPS, POLICY_SLOTS);
+    BENCH_POLICY_RUN("mm_heap (run-time)", mm_heap);
+    BENCH_POLICY_RUN("first fit", bench_first_heap);
+    BENCH_POLICY_RUN("best fit", bench_best_heap);
+    BENCH_POLICY_RUN("first fit, merge on free", bench_merging_heap);
+    BENCH_POLICY_RUN("compact, merge on free", bench_compact_merging_heap);
+}
+// ==== End policies =======
+
+// ==== headers: compact 4-byte headers =======
+//
+// Small-object traces on heaps with struct MetaData headers and with
+// mm_header_compact headers: the heap each one needs and how many objects of
+// the average size fit in a cache line.
+
+MM_DEFINE_HEAP(bench_meta_heap, mm_first_fit, mm_split_always, mm_coalesce_immediate, mm_lock_none, mm_header_meta)
+MM_DEFINE_HEAP(bench_compact_heap, mm_first_fit, mm_split_always, mm_coalesce_immediate, mm_lock_none, mm_header_compact)
+
+#define BENCH_HEADER_RUN(label, heap, min_size, max_size)                                            \
+    do                                                                                                \
+    {                                                                                                 \
+        __typeof__(heap##_create(0)) h = heap##_create(POLICY_HEAP_SIZE);                             \
+        char *slots[POLICY_SLOTS * 16];                                                               \
+        size_t live = 0;                                                                              \
+        unsigned seed = 11;                                                                           \
+        for (int i = 0; i < POLICY_SLOTS * 16; i++)                                                   \
+        {                                                                                             \
+            size_t size = min_size + bench_rand(&seed) % (max_size - min_size + 1);                   \
+            slots[i] = heap##_malloc(h, size);                                                        \
+            live += size;                                                                             \
+        }                                                                                             \
+        size_t used = h->current_break - h->start;                                                    \
+        printf("  %-8s %3d-%-3d %10zu %10zu %10.2f\n", label, min_size, max_size, live, used,         \
+               64.0 * (POLICY_SLOTS * 16) / used);                                                    \
+        for (int i = 0; i < POLICY_SLOTS * 16; i++)                                                   \
+            heap##_free(h, slots[i]);                                                                 \
+        heap##_destroy(h);                                                                            \
+    } while (0)
+
+void bench_headers()
+{
+    printf("headers: %d live objects\n", POLICY_SLOTS * 16);
+    printf("  %-8s %7s %10s %10s %10s\n", "header", "sizes", "live", "heap", "obj/line");
+    int ranges[][2] = {{16, 16}, {16, 32}, {32, 32}, {64, 128}};
+    for (int r = 0; r < 4; r++)
+    {
+        BENCH_HEADER_RUN("meta", bench_meta_heap, ranges[r][0], ranges[r][1]);
+        BENCH_HEADER_RUN("compact", bench_compact_heap, ranges[r][0], ranges[r][1]);
+    }
+}
+// ==== End headers =======
+
+// ==== coloring: lockstep streaming over large blocks =======
+//
+// Sums STREAM_ARRAYS large arrays element by element, the access pattern that
+// makes arrays starting at the same page offset fight over cache sets. Runs with
+// dedicated mappings and with heap extensions, with and without mm_set_coloring.
+
+#define STREAM_ARRAYS 32
+const size_t STREAM_ARRAY_SIZE = 256 * 1024;
+const int STREAM_PASSES = 200;
+
+double bench_stream(int mapped, int colors)
+{
+    bench_heap_init(BENCH_HEAP_SIZE);
+    mm_set_mmap_threshold(mapped ? STREAM_ARRAY_SIZE : 0);
+    mm_set_coloring(colors > 1 ? STREAM_ARRAY_SIZE : 0, colors);
+
+    long *a[STREAM_ARRAYS];
+    for (int i = 0; i < STREAM_ARRAYS; i++)
+    {
+        a[i] = mm_malloc(STREAM_ARRAY_SIZE);
+        for (size_t j = 0; j < STREAM_ARRAY_SIZE / sizeof(long); j++)
+            a[i][j] = j;
+    }
+
+    // Only the first 1 KB of each array, so the data fits in L1 unless it conflicts
+    const size_t n = 1024 / sizeof(long);
+    volatile long sink = 0;
+    unsigned long long start = bench_cycles();
+    for (int pass = 0; pass < STREAM_PASSES * 100; pass++)
+    {
+        long sum = 0;
+        for (size_t j = 0; j < n; j++)
+            for (int i = 0; i < STREAM_ARRAYS; i++)
+                sum += a[i][j];
+        sink += sum;
+    }
+    unsigned long long cycles = bench_cycles() - start;
+
+    for (int i = 0; i < STREAM_ARRAYS; i++)
+        mm_free(a[i]);
+    mm_set_coloring(0, 1);
+    return (double)cycles / ((double)STREAM_PASSES * 100 * n * STREAM_ARRAYS);
+}
+
+void bench_coloring()
+{
+    size_t threshold = mm_mmap_threshold;
+    printf("coloring: %d arrays of %zu KB summed in lockstep, cycles per element\n",
+           STREAM_ARRAYS, STREAM_ARRAY_SIZE / 1024);
+    printf("  %-14s %10s %10s\n", "blocks", "plain", "colored");
+    for (int mapped = 1; mapped >= 0; mapped--)
+    {
+        // Best of several runs, the differences are small against timer noise
+        double plain = 1e9, colored = 1e9;
+        for (int run = 0; run < 5; run++)
+        {
+            double t = bench_stream(mapped, 1);
+            plain = t < plain ? t : plain;
+            t = bench_stream(mapped, 64);
+            colored = t < colored ? t : colored;
+        }
+        printf("  %-14s %10.2f %10.2f\n", mapped ? "mappings" : "heap", plain, colored);
+    }
+    mm_set_mmap_threshold(threshold);
+}
+// ==== End coloring =======
+
+// ==== hints: lifetime-hinted placement =======
+//
+// A request loop that keeps one long-lived object per request and drops the
+// temporaries it allocated around it, as a server filling a cache would. Runs
+// once with plain mm_malloc and once with MM_HINT_SHORT_LIVED on the
+// temporaries, then reports the heap left behind once the temporaries are gone
+// and free blocks have been combined: heap in use over live bytes, the number
+// and bytes of free holes between live blocks, and the mm_get_stats
+// fragmentation ratio.
+
+const size_t HINTS_HEAP_SIZE = 16 * 1024 * 1024;
+const int HINTS_REQUESTS = 4000;
+#define HINTS_TEMPORARIES 8
+
+void bench_hints_run(int hinted)
+{
+    bench_heap_init(HINTS_HEAP_SIZE);
+    unsigned seed = 12345;
+    size_t live = 0;
+    for (int i = 0; i < HINTS_REQUESTS; i++)
+    {
+        char *temporaries[HINTS_TEMPORARIES];
+        for (int t = 0; t < HINTS_TEMPORARIES; t++)
+        {
+            size_t size = 64 + bench_rand(&seed) % 1024;
+            temporaries[t] = hinted ? mm_malloc_ex(size, MM_HINT_SHORT_LIVED) : mm_malloc(size);
+            if (t == HINTS_TEMPORARIES / 2)
+            {
+                size_t kept = 32 + bench_rand(&seed) % 256;
+                if ((hinted ? mm_malloc_ex(kept, MM_HINT_LONG_LIVED) : mm_malloc(kept)) != NULL)
+                    live += kept;
+            }
+        }
+        for (int t = 0; t < HINTS_TEMPORARIES; t++)
+            if (temporaries[t] != NULL)
+                mm_free(temporaries[t]);
+    }
+    mm_combine_nearby_free();
+
+    struct MMStats st;
+    mm_get_stats(&st);
+    size_t heap = (heap_current_break - heap_start) + (heap_end - mm_heap_upper_limit());
+    size_t holes = st.free_bytes - (mm_heap_upper_limit() - heap_current_break);
+    printf("  %-10s %10.2f %10d %10zu %10.3f\n", hinted ? "hinted" : "unhinted",
+           (double)heap / live, st.free_blocks, holes, st.fragmentation);
+}
+
+void bench_hints()
+{
+    printf("hints: %d requests, %d temporaries and one kept object each\n", HINTS_REQUESTS, HINTS_TEMPORARIES);
+    printf("  %-10s %10s %10s %10s %10s\n", "placement", "heap/live", "holes", "hole bytes", "frag");
+    bench_hints_run(0);
+    bench_hints_run(1);
+}
+// ==== End hints =======
+
+// ==== simulate: metadata-only simulator against the real heap =======
+//
+// Replays one random trace of SIMULATE_OPS mallocs and frees over SIMULATE_SLOTS
+// live slots, with a combine every SIMULATE_COMBINE_EVERY operations, through
+// mm_malloc/mm_free (filling payloads as the trace driver does) and through
+// sim_malloc/sim_free, per fit policy, and checks that both end with the same layout.
+
+const int SIMULATE_OPS = 400000;
+#define SIMULATE_SLOTS 2000
+const int SIMULATE_COMBINE_EVERY = 10000;
+
+double bench_simulate_run(int simulate, struct MMStats *st)
+{
+    static void *slots[SIMULATE_SLOTS];
+    memset(slots, 0, sizeof(slots));
+    bench_heap_init(BENCH_HEAP_SIZE);
+    sim_init(BENCH_HEAP_SIZE);
+    unsigned seed = 42;
+
+    double start = bench_now();
+    for (int i = 0; i < SIMULATE_OPS; i++)
+    {
+        int slot = bench_rand(&seed) % SIMULATE_SLOTS;
+        size_t size = 16 + bench_rand(&seed) % 2048;
+        if (slots[slot] != NULL)
+        {
+            if (simulate)
+                sim_free(slots[slot]);
+            else
+                mm_free(slots[slot]);
+            slots[slot] = NULL;
+        }
+        else if (simulate)
+        {
+            slots[slot] = sim_malloc(size);
+        }
+        else
+        {
+            slots[slot] = mm_malloc(size);
+            if (slots[slot] != NULL)
+                mm_fill(slots[slot], ' ', size);
+        }
+        if ((i + 1) % SIMULATE_COMBINE_EVERY == 0)
+            simulate ? sim_combine_nearby_free() : mm_combine_nearby_free();
+    }
+    double elapsed = bench_now() - start;
+
+    if (simulate)
+        sim_get_stats(st);
+    else
+        mm_get_stats(st);
+    return elapsed;
+}
+
+void bench_simulate()
+{
+    const char *policy_names[] = {"first", "best"};
+    int policies[] = {MM_FIT_FIRST, MM_FIT_BEST};
+
+    printf("simulate: %d operations on %d slots, seconds\n", SIMULATE_OPS, SIMULATE_SLOTS);
+    printf("  %-6s %10s %10s %10s %8s\n", "fit", "heap", "simulator", "speedup", "layout");
+    for (int f = 0; f < 2; f++)
+    {
+        mm_set_fit_policy(policies[f]);
+        struct MMStats real, sim;
+        double real_time = bench_simulate_run(0, &real);
+        double sim_time = bench_simulate_run(1, &sim);
+        int same = real.occupied_blocks == sim.occupied_blocks && real.free_blocks == sim.free_blocks &&
+                   real.occupied_bytes == sim.occupied_bytes && real.free_bytes == sim.free_bytes;
+        printf("  %-6s %10.3f %10.3f %9.1fx %8s\n", policy_names[f], real_time, sim_time,
+               real_time / sim_time, same ? "same" : "DIFFERS");
+    }
+    mm_set_fit_policy(MM_FIT_FIRST);
+    sim_init(0);
+}
+// ==== End simulate =======
+
+struct Benchmark
+{
+    const char *name;
+    void (*run)();
+};
+
+struct Benchmark benchmarks[] = {
+    {"realloc", bench_realloc},
+    {"kernels", bench_kernels},
+    {"prefault", bench_prefault},
+    {"stress", bench_stress},
+    {"fragment", bench_fragment},
+    {"policies", bench_policies},
+    {"headers", bench_headers},
+    {"coloring", bench_coloring},
+    {"hints", bench_hints},
+    {"simulate", bench_simulate},
+};
+
+int main(int argc, char **argv)
+{
+    int count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    for (int i = 0; i < count; i++)
+    {
+        int selected = argc == 1;
+        for (int j = 1; j < argc; j++)
+            if (strcmp(argv[j], benchmarks[i].name) == 0)
+                selected = 1;
+        if (selected)
+            benchmarks[i].run();
+    }
+    return 0;
+}